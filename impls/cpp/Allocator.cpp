@@ -0,0 +1,77 @@
+#include "Allocator.h"
+
+#include <new>
+
+struct FreeBlock {
+    FreeBlock* next;
+};
+
+static const size_t ClassCount = Allocator::MaxSize / Allocator::Granularity;
+static const size_t ChunkSize  = 64 * 1024;
+
+static thread_local FreeBlock* s_freeLists[ClassCount];
+static thread_local Allocator::Stats s_stats;
+
+static size_t sizeClass(size_t size)
+{
+    return (size == 0) ? 0 : (size - 1) / Allocator::Granularity;
+}
+
+static FreeBlock* refill(size_t index)
+{
+    const size_t blockSize = (index + 1) * Allocator::Granularity;
+    char* chunk = static_cast<char*>(::operator new(ChunkSize));
+    s_stats.residentBytes += ChunkSize;
+
+    // Thread the list through in address order, so that consecutive
+    // allocations are adjacent in memory.
+    FreeBlock* head = NULL;
+    for (size_t offset = ChunkSize - ChunkSize % blockSize; offset > 0; ) {
+        offset -= blockSize;
+        FreeBlock* block = reinterpret_cast<FreeBlock*>(chunk + offset);
+        block->next = head;
+        head = block;
+    }
+    return head;
+}
+
+void* Allocator::allocate(size_t size)
+{
+    if (size > MaxSize) {
+        s_stats.large++;
+        return ::operator new(size);
+    }
+
+    const size_t index = sizeClass(size);
+    FreeBlock* block = s_freeLists[index];
+    if (block != NULL) {
+        s_stats.hits++;
+    }
+    else {
+        s_stats.misses++;
+        block = refill(index);
+    }
+    s_freeLists[index] = block->next;
+    return block;
+}
+
+void Allocator::deallocate(void* p, size_t size)
+{
+    if (p == NULL) {
+        return;
+    }
+    if (size > MaxSize) {
+        ::operator delete(p);
+        return;
+    }
+
+    const size_t index = sizeClass(size);
+    FreeBlock* block = static_cast<FreeBlock*>(p);
+    block->next = s_freeLists[index];
+    s_freeLists[index] = block;
+}
+
+Allocator::Stats Allocator::stats()
+{
+    return s_stats;
+}
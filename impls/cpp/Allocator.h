@@ -0,0 +1,53 @@
+#ifndef INCLUDE_ALLOCATOR_H
+#define INCLUDE_ALLOCATOR_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Small blocks are served from per-thread free lists, one per size class,
+// which are refilled a chunk at a time. Freed blocks go back onto the free
+// list of the thread which frees them, and chunks are never returned to the
+// system. Anything larger than MaxSize goes straight to ::operator new.
+class Allocator {
+public:
+    static const size_t Granularity = 16;
+    static const size_t MaxSize     = 256;
+
+    struct Stats {
+        uint64_t hits;          // served from a free list
+        uint64_t misses;        // needed a new chunk first
+        uint64_t large;         // too big for any size class
+        uint64_t residentBytes; // held in chunks
+    };
+
+    static void* allocate(size_t size);
+    static void  deallocate(void* p, size_t size);
+
+    // Statistics for the calling thread.
+    static Stats stats();
+};
+
+// Standard allocator interface over Allocator, for containers.
+template<class T>
+class PoolAllocator {
+public:
+    typedef T value_type;
+
+    PoolAllocator() { }
+    template<class U> PoolAllocator(const PoolAllocator<U>&) { }
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(Allocator::allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, size_t n) {
+        Allocator::deallocate(p, n * sizeof(T));
+    }
+
+    template<class U>
+    bool operator == (const PoolAllocator<U>&) const { return true; }
+    template<class U>
+    bool operator != (const PoolAllocator<U>&) const { return false; }
+};
+
+#endif // INCLUDE_ALLOCATOR_H
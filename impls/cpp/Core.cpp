@@ -19,12 +19,17 @@
     checkArgsAtLeast(name.c_str(), expected, \
                         std::distance(argsBegin, argsEnd))
 
+typedef malValuePtr (malSet::*SetOp)(const malSet* that) const;
+static malValuePtr foldSets(const String& name,
+                            malValueIter argsBegin, malValueIter argsEnd,
+                            SetOp op);
 static String printValues(malValueIter begin, malValueIter end,
                            const String& sep, bool readably);
 
 static StaticList<malBuiltIn*> handlers;
 
 #define ARG(type, name) type* name = VALUE_CAST(type, *argsBegin++)
+#define ARG_INTEGER(name) int64_t name = mal::integerValue(*argsBegin++)
 
 #define FUNCNAME(uniq) builtIn ## uniq
 #define HRECNAME(uniq) handler ## uniq
@@ -52,20 +57,20 @@ static StaticList<malBuiltIn*> handlers;
 #define BUILTIN_INTOP(op, checkDivByZero) \
     BUILTIN(#op) { \
         CHECK_ARGS_IS(2); \
-        ARG(malInteger, lhs); \
-        ARG(malInteger, rhs); \
+        ARG_INTEGER(lhs); \
+        ARG_INTEGER(rhs); \
         if (checkDivByZero) { \
-            MAL_CHECK(rhs->value() != 0, "Division by zero"); \
+            MAL_CHECK(rhs != 0, "Division by zero"); \
         } \
-        return mal::integer(lhs->value() op rhs->value()); \
+        return mal::integer(lhs op rhs); \
     }
 
 BUILTIN_ISA("atom?",        malAtom);
 BUILTIN_ISA("keyword?",     malKeyword);
 BUILTIN_ISA("list?",        malList);
 BUILTIN_ISA("map?",         malHash);
-BUILTIN_ISA("number?",      malInteger);
 BUILTIN_ISA("sequential?",  malSequence);
+BUILTIN_ISA("set?",         malSet);
 BUILTIN_ISA("string?",      malString);
 BUILTIN_ISA("symbol?",      malSymbol);
 BUILTIN_ISA("vector?",      malVector);
@@ -82,85 +87,141 @@ BUILTIN_IS("nil?",          nilValue);
 BUILTIN("-")
 {
     int argCount = CHECK_ARGS_BETWEEN(1, 2);
-    ARG(malInteger, lhs);
+    ARG_INTEGER(lhs);
     if (argCount == 1) {
-        return mal::integer(- lhs->value());
+        return mal::integer(- lhs);
     }
 
-    ARG(malInteger, rhs);
-    return mal::integer(lhs->value() - rhs->value());
+    ARG_INTEGER(rhs);
+    return mal::integer(lhs - rhs);
 }
 
 BUILTIN("<=")
 {
     CHECK_ARGS_IS(2);
-    ARG(malInteger, lhs);
-    ARG(malInteger, rhs);
+    ARG_INTEGER(lhs);
+    ARG_INTEGER(rhs);
 
-    return mal::boolean(lhs->value() <= rhs->value());
+    return mal::boolean(lhs <= rhs);
 }
 
 BUILTIN(">=")
 {
     CHECK_ARGS_IS(2);
-    ARG(malInteger, lhs);
-    ARG(malInteger, rhs);
+    ARG_INTEGER(lhs);
+    ARG_INTEGER(rhs);
 
-    return mal::boolean(lhs->value() >= rhs->value());
+    return mal::boolean(lhs >= rhs);
 }
 
 BUILTIN("<")
 {
     CHECK_ARGS_IS(2);
-    ARG(malInteger, lhs);
-    ARG(malInteger, rhs);
+    ARG_INTEGER(lhs);
+    ARG_INTEGER(rhs);
 
-    return mal::boolean(lhs->value() < rhs->value());
+    return mal::boolean(lhs < rhs);
 }
 
 BUILTIN(">")
 {
     CHECK_ARGS_IS(2);
-    ARG(malInteger, lhs);
-    ARG(malInteger, rhs);
+    ARG_INTEGER(lhs);
+    ARG_INTEGER(rhs);
 
-    return mal::boolean(lhs->value() > rhs->value());
+    return mal::boolean(lhs > rhs);
 }
 
 BUILTIN("=")
 {
     CHECK_ARGS_IS(2);
-    const malValue* lhs = (*argsBegin++).ptr();
-    const malValue* rhs = (*argsBegin++).ptr();
+    const malValuePtr& lhs = *argsBegin++;
+    const malValuePtr& rhs = *argsBegin++;
 
-    return mal::boolean(lhs->isEqualTo(rhs));
+    return mal::boolean(mal::isEqual(lhs, rhs));
+}
+
+BUILTIN("alloc-stats")
+{
+    CHECK_ARGS_IS(0);
+    Allocator::Stats stats = Allocator::stats();
+
+    malValueVec items = {
+        mal::keyword(":hits"),           mal::integer(stats.hits),
+        mal::keyword(":misses"),         mal::integer(stats.misses),
+        mal::keyword(":large"),          mal::integer(stats.large),
+        mal::keyword(":resident-bytes"), mal::integer(stats.residentBytes),
+    };
+    return mal::hash(items.data(), items.data() + items.size(), true);
 }
 
 BUILTIN("apply")
 {
     CHECK_ARGS_AT_LEAST(2);
-    malValuePtr op = *argsBegin++; // this gets checked in APPLY
+    const malValuePtr& op = *argsBegin++; // this gets checked in APPLY
+    const malSequence* lastArg = VALUE_CAST(malSequence, *(argsEnd-1));
 
-    // Copy the first N-1 arguments in.
-    malValueVec args(argsBegin, argsEnd-1);
+    const malLambda* lambda = DYNAMIC_CAST(malLambda, op);
+    if (!lambda) {
+        // Builtins need arguments of their own (see APPLY), so they can't
+        // be handed the list's items.
+        malValueVec items(argsBegin, argsEnd-1);
+        GC_ROOT(items);
+        items.insert(items.end(), lastArg->begin(), lastArg->end());
+        return APPLY(op, items.data(), items.data() + items.size());
+    }
 
-    // Then append the argument as a list.
-    const malSequence* lastArg = VALUE_CAST(malSequence, *(argsEnd-1));
-    for (int i = 0; i < lastArg->count(); i++) {
-        args.push_back(lastArg->item(i));
+    // With no other arguments, the list can be used as it is.
+    malValuePtr args = *(argsEnd-1);
+    if (argsEnd - argsBegin > 1) {
+        // Copy the first N-1 arguments in, then append the list.
+        malValueVec* items = new malValueVec(argsBegin, argsEnd-1);
+        items->insert(items->end(), lastArg->begin(), lastArg->end());
+        args = mal::list(items);
     }
+    GC_ROOT(args);
 
-    return APPLY(op, args.begin(), args.end());
+    return EVAL(lambda->getBody(),
+                lambda->makeEnv(STATIC_CAST(malSequence, args)));
 }
 
 BUILTIN("assoc")
 {
     CHECK_ARGS_AT_LEAST(1);
+    if (malVector* vector = DYNAMIC_CAST(malVector, *argsBegin)) {
+        const malValuePtr& original = *argsBegin++;
+        malValuePtr result; // only set once there's a new vector
+        while (argsBegin != argsEnd) {
+            ARG_INTEGER(index);
+            MAL_CHECK(argsBegin != argsEnd, "assoc: missing value");
+            const malValuePtr& value = *argsBegin++;
+            // In place only when the result would be the same as a copy's.
+            if (!vector->assocInPlace(index, value)) {
+                result = vector->assoc(index, value);
+                vector = STATIC_CAST(malVector, result);
+            }
+        }
+        return result ? result : original;
+    }
+    const malValuePtr& map = *argsBegin;
     ARG(malHash, hash);
 
+    // In place only when the result would be the same as a copy's.
+    if (hash->assocInPlace(argsBegin, argsEnd)) {
+        return map;
+    }
     return hash->assoc(argsBegin, argsEnd);
 }
 
+BUILTIN("assoc!")
+{
+    CHECK_ARGS_AT_LEAST(1);
+    const malValuePtr& transient = *argsBegin;
+    ARG(malTransient, t);
+    t->assoc(argsBegin, argsEnd);
+    return transient;
+}
+
 BUILTIN("atom")
 {
     CHECK_ARGS_IS(1);
@@ -190,22 +251,44 @@ BUILTIN("concat")
 BUILTIN("conj")
 {
     CHECK_ARGS_AT_LEAST(1);
+    const malValuePtr& sequence = *argsBegin;
+    if (malSet* set = DYNAMIC_CAST(malSet, sequence)) {
+        ++argsBegin;
+        // In place only when the result would be the same as a copy's.
+        if (set->conjInPlace(argsBegin, argsEnd)) {
+            return sequence;
+        }
+        return set->conj(argsBegin, argsEnd);
+    }
     ARG(malSequence, seq);
 
+    malVector* vector = DYNAMIC_CAST(malVector, sequence);
+    // In place only when the result would be the same as a copy's.
+    if (vector && vector->conjInPlace(argsBegin, argsEnd)) {
+        return sequence;
+    }
     return seq->conj(argsBegin, argsEnd);
 }
 
+BUILTIN("conj!")
+{
+    CHECK_ARGS_AT_LEAST(1);
+    const malValuePtr& transient = *argsBegin;
+    ARG(malTransient, t);
+    t->conj(argsBegin, argsEnd);
+    return transient;
+}
+
 BUILTIN("cons")
 {
     CHECK_ARGS_IS(2);
-    malValuePtr first = *argsBegin++;
+    const malValuePtr& first = *argsBegin++;
     ARG(malSequence, rest);
 
-    malValueVec* items = new malValueVec(1 + rest->count());
-    items->at(0) = first;
-    std::copy(rest->begin(), rest->end(), items->begin() + 1);
-
-    return mal::list(items);
+    if (DYNAMIC_CAST(malList, rest)) {
+        return mal::cons(first, rest);
+    }
+    return mal::cons(first, mal::list(rest->begin(), rest->end()));
 }
 
 BUILTIN("contains?")
@@ -214,6 +297,9 @@ BUILTIN("contains?")
     if (*argsBegin == mal::nilValue()) {
         return *argsBegin;
     }
+    if (const malSet* set = DYNAMIC_CAST(malSet, *argsBegin)) {
+        return mal::boolean(set->contains(argsBegin[1]));
+    }
     ARG(malHash, hash);
     return mal::boolean(hash->contains(*argsBegin));
 }
@@ -224,6 +310,9 @@ BUILTIN("count")
     if (*argsBegin == mal::nilValue()) {
         return mal::integer(0);
     }
+    if (const malSet* set = DYNAMIC_CAST(malSet, *argsBegin)) {
+        return mal::integer(set->count());
+    }
 
     ARG(malSequence, seq);
     return mal::integer(seq->count());
@@ -237,17 +326,52 @@ BUILTIN("deref")
     return atom->deref();
 }
 
+BUILTIN("difference")
+{
+    return foldSets(name, argsBegin, argsEnd, &malSet::difference);
+}
+
+BUILTIN("disj")
+{
+    CHECK_ARGS_AT_LEAST(1);
+    const malValuePtr& original = *argsBegin;
+    ARG(malSet, set);
+
+    // In place only when the result would be the same as a copy's.
+    if (set->disjInPlace(argsBegin, argsEnd)) {
+        return original;
+    }
+    return set->disj(argsBegin, argsEnd);
+}
+
 BUILTIN("dissoc")
 {
     CHECK_ARGS_AT_LEAST(1);
+    const malValuePtr& map = *argsBegin;
     ARG(malHash, hash);
 
+    // In place only when the result would be the same as a copy's.
+    if (hash->dissocInPlace(argsBegin, argsEnd)) {
+        return map;
+    }
     return hash->dissoc(argsBegin, argsEnd);
 }
 
+BUILTIN("dissoc!")
+{
+    CHECK_ARGS_AT_LEAST(1);
+    const malValuePtr& transient = *argsBegin;
+    ARG(malTransient, t);
+    t->dissoc(argsBegin, argsEnd);
+    return transient;
+}
+
 BUILTIN("empty?")
 {
     CHECK_ARGS_IS(1);
+    if (const malSet* set = DYNAMIC_CAST(malSet, *argsBegin)) {
+        return mal::boolean(set->isEmpty());
+    }
     ARG(malSequence, seq);
 
     return mal::boolean(seq->isEmpty());
@@ -272,7 +396,7 @@ BUILTIN("first")
 BUILTIN("fn?")
 {
     CHECK_ARGS_IS(1);
-    malValuePtr arg = *argsBegin++;
+    const malValuePtr& arg = *argsBegin++;
 
     // Lambdas are functions, unless they're macros.
     if (const malLambda* lambda = DYNAMIC_CAST(malLambda, arg)) {
@@ -282,6 +406,29 @@ BUILTIN("fn?")
     return mal::boolean(DYNAMIC_CAST(malBuiltIn, arg));
 }
 
+BUILTIN("gc")
+{
+    CHECK_ARGS_IS(0);
+    return mal::integer(RefCounted::collectCycles());
+}
+
+BUILTIN("gc-stats")
+{
+    CHECK_ARGS_IS(0);
+    RefCounted::CycleStats stats = RefCounted::cycleStats();
+
+    malValueVec items = {
+        mal::keyword(":collections"),  mal::integer(stats.collections),
+        mal::keyword(":freed"),        mal::integer(stats.freed),
+        mal::keyword(":candidates"),   mal::integer(stats.candidates),
+        mal::keyword(":threshold"),    mal::integer(stats.threshold),
+        mal::keyword(":pause-us"),     mal::integer(stats.pauseMicros),
+        mal::keyword(":max-pause-us"), mal::integer(stats.maxPauseMicros),
+        mal::keyword(":queued"),       mal::integer(stats.queued),
+    };
+    return mal::hash(items.data(), items.data() + items.size(), true);
+}
+
 BUILTIN("get")
 {
     CHECK_ARGS_IS(2);
@@ -297,6 +444,22 @@ BUILTIN("hash-map")
     return mal::hash(argsBegin, argsEnd, true);
 }
 
+BUILTIN("hash-set")
+{
+    return mal::set(argsBegin, argsEnd, true);
+}
+
+BUILTIN("identical?")
+{
+    CHECK_ARGS_IS(2);
+    return mal::boolean(argsBegin[0] == argsBegin[1]);
+}
+
+BUILTIN("intersection")
+{
+    return foldSets(name, argsBegin, argsEnd, &malSet::intersection);
+}
+
 BUILTIN("keys")
 {
     CHECK_ARGS_IS(1);
@@ -307,7 +470,7 @@ BUILTIN("keys")
 BUILTIN("keyword")
 {
     CHECK_ARGS_IS(1);
-    const malValuePtr arg = *argsBegin++;
+    const malValuePtr& arg = *argsBegin++;
     if (malKeyword* s = DYNAMIC_CAST(malKeyword, arg))
       return s;
     if (const malString* s = DYNAMIC_CAST(malString, arg))
@@ -332,37 +495,51 @@ BUILTIN("macro?")
 BUILTIN("map")
 {
     CHECK_ARGS_IS(2);
-    malValuePtr op = *argsBegin++; // this gets checked in APPLY
+    const malValuePtr& op = *argsBegin++; // this gets checked in APPLY
     ARG(malSequence, source);
 
     const int length = source->count();
-    malValueVec* items = new malValueVec(length);
+    malValueVec items(length);
+    GC_ROOT(items);
     auto it = source->begin();
     for (int i = 0; i < length; i++) {
-      items->at(i) = APPLY(op, it+i, it+i+1);
+      malValuePtr arg = it[i]; // see APPLY
+      items[i] = APPLY(op, &arg, &arg + 1);
     }
 
-    return  mal::list(items);
+    return  mal::list(items.data(), items.data() + length);
 }
 
 BUILTIN("meta")
 {
     CHECK_ARGS_IS(1);
-    malValuePtr obj = *argsBegin++;
+    const malValuePtr& obj = *argsBegin++;
 
-    return obj->meta();
+    return mal::meta(obj);
 }
 
 BUILTIN("nth")
 {
     CHECK_ARGS_IS(2);
     ARG(malSequence, seq);
-    ARG(malInteger,  index);
+    ARG_INTEGER(index);
+
+    MAL_CHECK(index >= 0 && index < seq->count(), "Index out of range");
 
-    int i = index->value();
-    MAL_CHECK(i >= 0 && i < seq->count(), "Index out of range");
+    return seq->item(index);
+}
 
-    return seq->item(i);
+BUILTIN("number?")
+{
+    CHECK_ARGS_IS(1);
+    return mal::boolean(mal::isInteger(*argsBegin));
+}
+
+BUILTIN("persistent!")
+{
+    CHECK_ARGS_IS(1);
+    ARG(malTransient, t);
+    return t->persistent();
 }
 
 BUILTIN("pr-str")
@@ -415,10 +592,40 @@ BUILTIN("rest")
     return seq->rest();
 }
 
+BUILTIN("set")
+{
+    CHECK_ARGS_IS(1);
+    const malValuePtr& arg = *argsBegin;
+    if (arg == mal::nilValue()) {
+        return mal::set(argsBegin, argsBegin, true);
+    }
+    if (DYNAMIC_CAST(malSet, arg)) {
+        return arg;
+    }
+    ARG(malSequence, seq);
+    return mal::set(seq->begin(), seq->end(), true);
+}
+
+BUILTIN("set-hash-consing!")
+{
+    CHECK_ARGS_IS(1);
+    setHashConsing(mal::isTrue(*argsBegin));
+    return mal::nilValue();
+}
+
+BUILTIN("set-reclaim-budget!")
+{
+    CHECK_ARGS_IS(1);
+    ARG_INTEGER(budget);
+
+    RefCounted::setReclaimBudget(budget);
+    return mal::nilValue();
+}
+
 BUILTIN("seq")
 {
     CHECK_ARGS_IS(1);
-    malValuePtr arg = *argsBegin++;
+    const malValuePtr& arg = *argsBegin++;
     if (arg == mal::nilValue()) {
         return mal::nilValue();
     }
@@ -426,8 +633,11 @@ BUILTIN("seq")
         return seq->isEmpty() ? mal::nilValue()
                               : mal::list(seq->begin(), seq->end());
     }
+    if (const malSet* set = DYNAMIC_CAST(malSet, arg)) {
+        return set->isEmpty() ? mal::nilValue() : set->seq();
+    }
     if (const malString* strVal = DYNAMIC_CAST(malString, arg)) {
-        const String str = strVal->value();
+        const String& str = strVal->value();
         int length = str.length();
         if (length == 0)
             return mal::nilValue();
@@ -438,7 +648,8 @@ BUILTIN("seq")
         }
         return mal::list(items);
     }
-    MAL_FAIL("%s is not a string or sequence", arg->print(true).c_str());
+    MAL_FAIL("%s is not a string or sequence",
+             mal::print(arg, true).c_str());
 }
 
 
@@ -463,7 +674,49 @@ BUILTIN("slurp")
 
 BUILTIN("str")
 {
-    return mal::string(printValues(argsBegin, argsEnd, "", false));
+    // Strings long enough to be worth it are joined as ropes, so building
+    // one up with (str acc piece) takes linear time rather than quadratic.
+    malValuePtr result;
+    String pending;
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        const malString* s = DYNAMIC_CAST(malString, *it);
+        if (!s || (s->length() < malString::RopeThreshold)) {
+            pending += mal::print(*it, false);
+            continue;
+        }
+        if (!pending.empty()) {
+            malValuePtr piece = mal::string(pending);
+            result = result ? malString::concat(result, piece) : piece;
+            pending.clear();
+        }
+        if (result) {
+            result = malString::concat(result, *it);
+        }
+        else {
+            // The result mustn't carry the argument's metadata.
+            result = (s->meta() == mal::nilValue())
+                ? *it : s->substring(0, s->length());
+        }
+    }
+    if (!result) {
+        return mal::string(pending);
+    }
+    return pending.empty() ? result
+                           : malString::concat(result, mal::string(pending));
+}
+
+BUILTIN("subs")
+{
+    CHECK_ARGS_BETWEEN(2, 3);
+    ARG(malString, str);
+    ARG_INTEGER(start);
+    int64_t length = str->length();
+    int64_t end = (argsBegin != argsEnd) ? mal::integerValue(*argsBegin++)
+                                         : length;
+    MAL_CHECK(0 <= start && start <= end && end <= length,
+              "subs: index out of range");
+
+    return str->substring(start, end - start);
 }
 
 BUILTIN("swap!")
@@ -471,14 +724,15 @@ BUILTIN("swap!")
     CHECK_ARGS_AT_LEAST(2);
     ARG(malAtom, atom);
 
-    malValuePtr op = *argsBegin++; // this gets checked in APPLY
+    const malValuePtr& op = *argsBegin++; // this gets checked in APPLY
 
     malValueVec args(1 + argsEnd - argsBegin);
+    GC_ROOT(args);
     args[0] = atom->deref();
     std::copy(argsBegin, argsEnd, args.begin() + 1);
 
-    malValuePtr value = APPLY(op, args.begin(), args.end());
-    return atom->reset(value);
+    malValuePtr value = APPLY(op, args.data(), args.data() + args.size());
+    return atom->reset(std::move(value));
 }
 
 BUILTIN("symbol")
@@ -506,6 +760,24 @@ BUILTIN("time-ms")
     return mal::integer(ms.count());
 }
 
+BUILTIN("transient")
+{
+    CHECK_ARGS_IS(1);
+    if (malVector* vector = DYNAMIC_CAST(malVector, *argsBegin)) {
+        return malValuePtr(new malTransient(vector->trie()));
+    }
+    ARG(malHash, hash);
+    return malValuePtr(new malTransient(hash->map()));
+}
+
+BUILTIN("union")
+{
+    if (argsBegin == argsEnd) {
+        return mal::set(argsBegin, argsEnd, true);
+    }
+    return foldSets(name, argsBegin, argsEnd, &malSet::unionWith);
+}
+
 BUILTIN("vals")
 {
     CHECK_ARGS_IS(1);
@@ -528,31 +800,48 @@ BUILTIN("vector")
 BUILTIN("with-meta")
 {
     CHECK_ARGS_IS(2);
-    malValuePtr obj  = *argsBegin++;
-    malValuePtr meta = *argsBegin++;
-    return obj->withMeta(meta);
+    const malValuePtr& obj  = *argsBegin++;
+    const malValuePtr& meta = *argsBegin++;
+    return mal::withMeta(obj, meta);
 }
 
 void installCore(malEnvPtr env) {
     for (auto it = handlers.begin(), end = handlers.end(); it != end; ++it) {
         malBuiltIn* handler = *it;
+        handler->makeImmortal();
         env->set(handler->name(), handler);
     }
 }
 
+// Applies op to the first set and each of the others in turn.
+static malValuePtr foldSets(const String& name,
+                            malValueIter argsBegin, malValueIter argsEnd,
+                            SetOp op)
+{
+    CHECK_ARGS_AT_LEAST(1);
+    malValuePtr result = *argsBegin;
+    ARG(malSet, set);
+    while (argsBegin != argsEnd) {
+        ARG(malSet, that);
+        result = (set->*op)(that);
+        set = STATIC_CAST(malSet, result);
+    }
+    return result;
+}
+
 static String printValues(malValueIter begin, malValueIter end,
                           const String& sep, bool readably)
 {
     String out;
 
     if (begin != end) {
-        out += (*begin)->print(readably);
+        out += mal::print(*begin, readably);
         ++begin;
     }
 
     for ( ; begin != end; ++begin) {
         out += sep;
-        out += (*begin)->print(readably);
+        out += mal::print(*begin, readably);
     }
 
     return out;
@@ -3,24 +3,55 @@
 
 #include <algorithm>
 
+struct FreeFrame {
+    FreeFrame* next;
+};
+
+static thread_local FreeFrame* s_freeFrames = NULL;
+
+void* malEnv::operator new(size_t size)
+{
+    if ((size == sizeof(malEnv)) && (s_freeFrames != NULL)) {
+        FreeFrame* frame = s_freeFrames;
+        s_freeFrames = frame->next;
+        return frame;
+    }
+    return Allocator::allocate(size);
+}
+
+void malEnv::operator delete(void* p, size_t size)
+{
+    if (size == sizeof(malEnv)) {
+        FreeFrame* frame = static_cast<FreeFrame*>(p);
+        frame->next = s_freeFrames;
+        s_freeFrames = frame;
+        return;
+    }
+    Allocator::deallocate(p, size);
+}
+
 malEnv::malEnv(malEnvPtr outer)
-: m_outer(outer)
+: m_inlineCount(0)
+, m_outer(outer)
 {
     TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
 }
 
-malEnv::malEnv(malEnvPtr outer, const StringVec& bindings,
-               malValueIter argsBegin, malValueIter argsEnd)
-: m_outer(outer)
+malEnv::malEnv(malEnvPtr outer, const malSymbolVec& bindings,
+               malValueIter argsBegin, malValueIter argsEnd,
+               const malSequence* args)
+: m_inlineCount(0)
+, m_outer(outer)
 {
     TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
     int n = bindings.size();
     auto it = argsBegin;
     for (int i = 0; i < n; i++) {
-        if (bindings[i] == "&") {
+        if (bindings[i]->id() == SYM_AMPERSAND) {
             MAL_CHECK(i == n - 2, "There must be one parameter after the &");
 
-            set(bindings[n-1], mal::list(it, argsEnd));
+            set(bindings[n-1], args ? args->drop(it - argsBegin)
+                                    : mal::list(it, argsEnd));
             return;
         }
         MAL_CHECK(it != argsEnd, "Not enough parameters");
@@ -35,31 +66,137 @@ malEnv::~malEnv()
     TRACE_ENV("Destroying malEnv %p, outer=%p\n", this, m_outer.ptr());
 }
 
-malEnvPtr malEnv::find(const String& symbol)
+void malEnv::visitChildren(Visitor& visitor) const
+{
+    for (int i = 0; i < m_inlineCount; i++) {
+        m_inline[i].value.visit(visitor);
+    }
+    for (auto it = m_spill.begin(), end = m_spill.end(); it != end; ++it) {
+        it->value.visit(visitor);
+    }
+    for (auto it = m_table.begin(), end = m_table.end(); it != end; ++it) {
+        it->visit(visitor);
+    }
+    m_outer.visit(visitor);
+}
+
+void malEnv::clearReferences()
+{
+    for (int i = 0; i < m_inlineCount; i++) {
+        m_inline[i].value = malValuePtr();
+    }
+    m_inlineCount = 0;
+    m_spill.clear();
+    m_table.clear();
+    m_outer = malEnvPtr();
+}
+
+const malValuePtr* malEnv::lookup(int id) const
+{
+    if (!m_table.empty()) {
+        if ((id < (int)m_table.size()) && m_table[id]) {
+            return &m_table[id];
+        }
+        return NULL;
+    }
+    for (int i = 0; i < m_inlineCount; i++) {
+        if (m_inline[i].id == id) {
+            return &m_inline[i].value;
+        }
+    }
+    for (auto it = m_spill.begin(), end = m_spill.end(); it != end; ++it) {
+        if (it->id == id) {
+            return &it->value;
+        }
+    }
+    return NULL;
+}
+
+malEnvPtr malEnv::find(const malSymbol* symbol)
 {
-    for (malEnvPtr env = this; env; env = env->m_outer) {
-        if (env->m_map.find(symbol) != env->m_map.end()) {
+    const int id = symbol->id();
+    for (malEnv* env = this; env; env = env->m_outer.ptr()) {
+        if (env->lookup(id) != NULL) {
             return env;
         }
     }
     return NULL;
 }
 
+malEnvPtr malEnv::find(const String& symbol)
+{
+    return find(STATIC_CAST(malSymbol, mal::symbol(symbol)));
+}
+
+malValuePtr malEnv::get(const malSymbol* symbol)
+{
+    const int id = symbol->id();
+    for (malEnv* env = this; env; env = env->m_outer.ptr()) {
+        if (const malValuePtr* value = env->lookup(id)) {
+            return *value;
+        }
+    }
+    MAL_FAIL("'%s' not found", symbol->value().c_str());
+}
+
 malValuePtr malEnv::get(const String& symbol)
 {
-    for (malEnvPtr env = this; env; env = env->m_outer) {
-        auto it = env->m_map.find(symbol);
-        if (it != env->m_map.end()) {
-            return it->second;
+    return get(STATIC_CAST(malSymbol, mal::symbol(symbol)));
+}
+
+malValuePtr malEnv::set(const malSymbol* symbol, malValuePtr value)
+{
+    // Frames are only candidates for the cycle collector once they hold
+    // something which could refer back to them, or a closure is made over
+    // them (see malLambda).
+    if (value && !value.isTagged() && value->mayBeCyclic()) {
+        setMayBeCyclic();
+    }
+
+    const int id = symbol->id();
+    if (const malValuePtr* existing = lookup(id)) {
+        return *const_cast<malValuePtr*>(existing) = std::move(value);
+    }
+
+    if (!m_table.empty()) {
+        if (id >= (int)m_table.size()) {
+            m_table.resize(std::max(id + 1, (int)m_table.size() * 2));
         }
+        return m_table[id] = std::move(value);
+    }
+    if (m_inlineCount < InlineCount) {
+        m_inline[m_inlineCount].id = id;
+        return m_inline[m_inlineCount++].value = std::move(value);
+    }
+    if (m_spill.size() < SpillLimit) {
+        Binding binding = { id, std::move(value) };
+        m_spill.push_back(std::move(binding));
+        return m_spill.back().value;
+    }
+
+    // This frame has got too big to search, so index it by symbol id.
+    int maxId = id;
+    for (auto it = m_spill.begin(), end = m_spill.end(); it != end; ++it) {
+        maxId = std::max(maxId, it->id);
+    }
+    for (int i = 0; i < m_inlineCount; i++) {
+        maxId = std::max(maxId, m_inline[i].id);
+    }
+    m_table.resize(maxId + 1);
+    for (int i = 0; i < m_inlineCount; i++) {
+        m_table[m_inline[i].id] = std::move(m_inline[i].value);
+    }
+    for (auto it = m_spill.begin(), end = m_spill.end(); it != end; ++it) {
+        m_table[it->id] = std::move(it->value);
     }
-    MAL_FAIL("'%s' not found", symbol.c_str());
+    m_inlineCount = 0;
+    BindingVec().swap(m_spill);
+    return m_table[id] = std::move(value);
 }
 
 malValuePtr malEnv::set(const String& symbol, malValuePtr value)
 {
-    m_map[symbol] = value;
-    return value;
+    return set(STATIC_CAST(malSymbol, mal::symbol(symbol)), std::move(value));
 }
 
 malEnvPtr malEnv::getRoot()
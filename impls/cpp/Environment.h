@@ -3,27 +3,56 @@
 
 #include "MAL.h"
 
-#include <map>
-
 class malEnv : public RefCounted {
 public:
     malEnv(malEnvPtr outer = NULL);
+    // If args is given, argsBegin and argsEnd must be its items, and a &
+    // parameter is bound to a slice of it rather than a copy.
     malEnv(malEnvPtr outer,
-           const StringVec& bindings,
+           const malSymbolVec& bindings,
            malValueIter argsBegin,
-           malValueIter argsEnd);
+           malValueIter argsEnd,
+           const malSequence* args = NULL);
 
     ~malEnv();
 
+    malValuePtr get(const malSymbol* symbol);
+    malEnvPtr   find(const malSymbol* symbol);
+    malValuePtr set(const malSymbol* symbol, malValuePtr value);
+    malEnvPtr   getRoot();
+
+    // These intern the name first, so prefer the malSymbol versions.
     malValuePtr get(const String& symbol);
     malEnvPtr   find(const String& symbol);
     malValuePtr set(const String& symbol, malValuePtr value);
-    malEnvPtr   getRoot();
+
+    virtual void visitChildren(Visitor& visitor) const;
+    virtual void clearReferences();
+
+    // Frames are recycled through a free list of their own.
+    static void* operator new(size_t size);
+    static void operator delete(void* p, size_t size);
 
 private:
-    typedef std::map<String, malValuePtr> Map;
-    Map m_map;
-    malEnvPtr m_outer;
+    struct Binding {
+        int         id;
+        malValuePtr value;
+    };
+    typedef std::vector<Binding, PoolAllocator<Binding> > BindingVec;
+
+    const malValuePtr* lookup(int id) const;
+
+    // Most frames only bind a few symbols, and those are held inline, so
+    // a frame is a single allocation. Larger frames spill into m_spill,
+    // and the largest, such as the REPL's, are indexed by symbol id.
+    static const int InlineCount = 4;
+    static const int SpillLimit  = 32;
+
+    Binding     m_inline[InlineCount];
+    int         m_inlineCount;
+    BindingVec  m_spill;
+    malValueVec m_table;
+    malEnvPtr   m_outer;
 };
 
 #endif // INCLUDE_ENVIRONMENT_H
@@ -0,0 +1,444 @@
+#include "HashTrie.h"
+#include "Types.h"
+
+static const uint32_t Mask = (1 << HashTrie::Bits) - 1;
+static const int      MaxShift = 8 * sizeof(size_t);
+
+static size_t hashKey(const malValuePtr& key)
+{
+    return mal::hashValue(key);
+}
+
+static bool keysEqual(const malValuePtr& lhs, const malValuePtr& rhs)
+{
+    return (lhs == rhs) || mal::isEqual(lhs, rhs);
+}
+
+static uint32_t bitFor(size_t hash, int shift)
+{
+    return 1u << ((hash >> shift) & Mask);
+}
+
+static int indexFor(uint32_t bitmap, uint32_t bit)
+{
+    return __builtin_popcount(bitmap & (bit - 1));
+}
+
+HashNode::HashNode(Kind kind, uint32_t bitmap, HashEntryVec& entries)
+: m_kind(kind)
+, m_bitmap(bitmap)
+, m_entries(std::move(entries))
+{
+    for (auto it = m_entries.begin(), end = m_entries.end(); it != end; ++it) {
+        if ((it->child && it->child->mayBeCyclic()) ||
+            (it->key && !it->key.isTagged() && it->key->mayBeCyclic()) ||
+            (it->value && !it->value.isTagged() && it->value->mayBeCyclic())) {
+            setMayBeCyclic();
+            break;
+        }
+    }
+}
+
+void HashNode::visitChildren(Visitor& visitor) const
+{
+    for (auto it = m_entries.begin(), end = m_entries.end(); it != end; ++it) {
+        it->key.visit(visitor);
+        it->value.visit(visitor);
+        it->child.visit(visitor);
+    }
+}
+
+// An empty bitmap makes a collision node.
+static HashNodePtr makeNode(uint32_t bitmap, HashEntryVec& entries)
+{
+    return HashNodePtr(new HashNode(bitmap ? HashNode::Bitmap
+                                           : HashNode::Collision,
+                                    bitmap, entries));
+}
+
+static HashNodePtr makeArrayNode(HashEntryVec& entries)
+{
+    return HashNodePtr(new HashNode(HashNode::Array, 0, entries));
+}
+
+// Nodes are changed in place, rather than copied, if nothing else refers
+// to them, or to any node above them. entry must be the new entry, once
+// it's been stored.
+static HashNode* editable(const HashNodePtr& ptr, const HashEntry& entry)
+{
+    HashNode* node = ptr.ptr();
+    if ((entry.child && entry.child->mayBeCyclic()) ||
+        (entry.key && !entry.key.isTagged() && entry.key->mayBeCyclic()) ||
+        (entry.value && !entry.value.isTagged() &&
+         entry.value->mayBeCyclic())) {
+        node->setMayBeCyclic();
+    }
+    return node;
+}
+
+// Returns node with the entry at index replaced.
+static HashNodePtr replaceEntry(const HashNodePtr& ptr, bool inPlace,
+                                int index, const HashEntry& entry)
+{
+    if (inPlace) {
+        editable(ptr, entry)->m_entries[index] = entry;
+        return ptr;
+    }
+    HashEntryVec entries(ptr->m_entries);
+    entries[index] = entry;
+    return HashNodePtr(new HashNode(ptr->m_kind, ptr->m_bitmap, entries));
+}
+
+// Returns node with the entry added at the end. Only for collision and
+// array nodes.
+static HashNodePtr appendEntry(const HashNodePtr& ptr, bool inPlace,
+                               const HashEntry& entry)
+{
+    if (inPlace) {
+        editable(ptr, entry)->m_entries.push_back(entry);
+        return ptr;
+    }
+    HashEntryVec entries(ptr->m_entries);
+    entries.push_back(entry);
+    return HashNodePtr(new HashNode(ptr->m_kind, ptr->m_bitmap, entries));
+}
+
+static HashNodePtr insertEntry(const HashNodePtr& ptr, bool inPlace,
+                               uint32_t bit, int index, const HashEntry& entry)
+{
+    if (inPlace) {
+        HashNode* node = editable(ptr, entry);
+        node->m_entries.insert(node->m_entries.begin() + index, entry);
+        node->m_bitmap |= bit;
+        return ptr;
+    }
+    const HashNode* node = ptr.ptr();
+    HashEntryVec entries;
+    entries.reserve(node->m_entries.size() + 1);
+    entries.insert(entries.end(), node->m_entries.begin(),
+                                  node->m_entries.begin() + index);
+    entries.push_back(entry);
+    entries.insert(entries.end(), node->m_entries.begin() + index,
+                                  node->m_entries.end());
+    return makeNode(node->m_bitmap | bit, entries);
+}
+
+// Returns NULL if that leaves the node empty.
+static HashNodePtr removeEntry(const HashNodePtr& ptr, bool inPlace,
+                               uint32_t bit, int index)
+{
+    if (ptr->m_entries.size() == 1) {
+        return HashNodePtr();
+    }
+    if (inPlace) {
+        HashNode* node = ptr.ptr();
+        node->m_entries.erase(node->m_entries.begin() + index);
+        node->m_bitmap &= ~bit;
+        return ptr;
+    }
+    HashEntryVec entries(ptr->m_entries);
+    entries.erase(entries.begin() + index);
+    return HashNodePtr(new HashNode(ptr->m_kind, ptr->m_bitmap & ~bit,
+                                    entries));
+}
+
+// Makes a node holding two entries whose hashes agree below shift.
+static HashNodePtr pairNode(int shift, const HashEntry& a, const HashEntry& b)
+{
+    HashEntryVec entries;
+    if (a.hash == b.hash || shift >= MaxShift) {
+        entries.push_back(a);
+        entries.push_back(b);
+        return makeNode(0, entries);
+    }
+
+    uint32_t aBit = bitFor(a.hash, shift);
+    uint32_t bBit = bitFor(b.hash, shift);
+    if (aBit == bBit) {
+        HashEntry entry = { a.hash, malValuePtr(), malValuePtr(),
+                            pairNode(shift + HashTrie::Bits, a, b) };
+        entries.push_back(entry);
+    }
+    else if (aBit < bBit) {
+        entries.push_back(a);
+        entries.push_back(b);
+    }
+    else {
+        entries.push_back(b);
+        entries.push_back(a);
+    }
+    return makeNode(aBit | bBit, entries);
+}
+
+static const malValuePtr* findIn(const HashNode* node, int shift,
+                                 size_t hash, const malValuePtr& key)
+{
+    while (node) {
+        if (node->isCollision()) {
+            for (auto it = node->m_entries.begin(),
+                      end = node->m_entries.end(); it != end; ++it) {
+                if (it->hash == hash && keysEqual(it->key, key)) {
+                    return &it->value;
+                }
+            }
+            return NULL;
+        }
+
+        uint32_t bit = bitFor(hash, shift);
+        if (!(node->m_bitmap & bit)) {
+            return NULL;
+        }
+        const HashEntry& entry =
+            node->m_entries[indexFor(node->m_bitmap, bit)];
+        if (!entry.child) {
+            return (entry.hash == hash && keysEqual(entry.key, key))
+                ? &entry.value : NULL;
+        }
+        node = entry.child.ptr();
+        shift += HashTrie::Bits;
+    }
+    return NULL;
+}
+
+// inPlace says whether the node's parent can be changed in place.
+static HashNodePtr assocIn(const HashNodePtr& ptr, bool inPlace, int shift,
+                           const HashEntry& entry, bool& added)
+{
+    const HashNode* node = ptr.ptr();
+    inPlace = inPlace && ptr->isUnique();
+    if (node->isCollision()) {
+        if (node->m_entries[0].hash != entry.hash) {
+            // Push the collisions down a level to make room for this key.
+            HashEntry collisions = { node->m_entries[0].hash, malValuePtr(),
+                                     malValuePtr(), ptr };
+            HashEntryVec entries(1, collisions);
+            HashNodePtr parent =
+                makeNode(bitFor(collisions.hash, shift), entries);
+            return assocIn(parent, true, shift, entry, added);
+        }
+        for (size_t i = 0; i < node->m_entries.size(); i++) {
+            if (keysEqual(node->m_entries[i].key, entry.key)) {
+                return replaceEntry(ptr, inPlace, i, entry);
+            }
+        }
+        added = true;
+        return appendEntry(ptr, inPlace, entry);
+    }
+
+    uint32_t bit = bitFor(entry.hash, shift);
+    int index = indexFor(node->m_bitmap, bit);
+    if (!(node->m_bitmap & bit)) {
+        added = true;
+        return insertEntry(ptr, inPlace, bit, index, entry);
+    }
+
+    const HashEntry& existing = node->m_entries[index];
+    if (existing.child) {
+        // Copying the entry before recursing would share the child.
+        HashNodePtr child = assocIn(existing.child, inPlace,
+                                    shift + HashTrie::Bits, entry, added);
+        HashEntry replacement = existing;
+        replacement.child = child;
+        return replaceEntry(ptr, inPlace, index, replacement);
+    }
+    if (existing.hash == entry.hash && keysEqual(existing.key, entry.key)) {
+        if (existing.value == entry.value) {
+            return ptr;
+        }
+        return replaceEntry(ptr, inPlace, index, entry);
+    }
+
+    added = true;
+    HashEntry replacement = { existing.hash, malValuePtr(), malValuePtr(),
+                              pairNode(shift + HashTrie::Bits,
+                                       existing, entry) };
+    return replaceEntry(ptr, inPlace, index, replacement);
+}
+
+static HashNodePtr dissocIn(const HashNodePtr& ptr, bool inPlace, int shift,
+                            size_t hash, const malValuePtr& key,
+                            bool& removed)
+{
+    const HashNode* node = ptr.ptr();
+    inPlace = inPlace && ptr->isUnique();
+    if (node->isCollision()) {
+        for (size_t i = 0; i < node->m_entries.size(); i++) {
+            if (node->m_entries[i].hash == hash &&
+                keysEqual(node->m_entries[i].key, key)) {
+                removed = true;
+                return removeEntry(ptr, inPlace, 0, i);
+            }
+        }
+        return ptr;
+    }
+
+    uint32_t bit = bitFor(hash, shift);
+    if (!(node->m_bitmap & bit)) {
+        return ptr;
+    }
+    int index = indexFor(node->m_bitmap, bit);
+    const HashEntry& existing = node->m_entries[index];
+    if (existing.child) {
+        HashNodePtr child = dissocIn(existing.child, inPlace,
+                                     shift + HashTrie::Bits, hash, key,
+                                     removed);
+        if (!removed) {
+            return ptr;
+        }
+        if (!child) {
+            return removeEntry(ptr, inPlace, bit, index);
+        }
+        HashEntry replacement = existing;
+        replacement.child = child;
+        return replaceEntry(ptr, inPlace, index, replacement);
+    }
+    if (existing.hash == hash && keysEqual(existing.key, key)) {
+        removed = true;
+        return removeEntry(ptr, inPlace, bit, index);
+    }
+    return ptr;
+}
+
+// Returns the index of key in an array node, or -1.
+static int arrayIndex(const HashNode* node, const malValuePtr& key)
+{
+    // Interned keys usually match by address, so try that first.
+    for (size_t i = 0; i < node->m_entries.size(); i++) {
+        if (node->m_entries[i].key == key) {
+            return i;
+        }
+    }
+    for (size_t i = 0; i < node->m_entries.size(); i++) {
+        if (mal::isEqual(node->m_entries[i].key, key)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const malValuePtr* HashTrie::find(const malValuePtr& key) const
+{
+    if (m_root && m_root->isArray()) {
+        int index = arrayIndex(m_root.ptr(), key);
+        return (index < 0) ? NULL : &m_root->m_entries[index].value;
+    }
+    return findIn(m_root.ptr(), 0, hashKey(key), key);
+}
+
+HashTrie HashTrie::assoc(const malValuePtr& key,
+                         const malValuePtr& value) const
+{
+    HashTrie result(*this);
+    result.set(key, value);
+    return result;
+}
+
+HashTrie HashTrie::dissoc(const malValuePtr& key) const
+{
+    HashTrie result(*this);
+    result.erase(key);
+    return result;
+}
+
+void HashTrie::set(const malValuePtr& key, const malValuePtr& value)
+{
+    if (m_root && !m_root->isArray()) {
+        setHashed(key, value);
+        return;
+    }
+
+    int index = m_root ? arrayIndex(m_root.ptr(), key) : -1;
+    HashEntry entry = { 0, key, value, HashNodePtr() };
+    if (index >= 0) {
+        if (m_root->m_entries[index].value != value) {
+            m_root = replaceEntry(m_root, m_root->isUnique(), index, entry);
+        }
+        return;
+    }
+    if (m_count < ArrayLimit) {
+        if (m_root) {
+            m_root = appendEntry(m_root, m_root->isUnique(), entry);
+        }
+        else {
+            HashEntryVec entries(1, entry);
+            m_root = makeArrayNode(entries);
+        }
+        m_count++;
+        return;
+    }
+
+    // This is one too many for an array, so hash all the keys.
+    HashTrie hashed;
+    for (auto it = begin(), itEnd = end(); it != itEnd; ++it) {
+        hashed.setHashed(it->key, it->value);
+    }
+    hashed.setHashed(key, value);
+    *this = hashed;
+}
+
+void HashTrie::setHashed(const malValuePtr& key, const malValuePtr& value)
+{
+    HashEntry entry = { hashKey(key), key, value, HashNodePtr() };
+    if (!m_root) {
+        HashEntryVec entries(1, entry);
+        m_root = makeNode(bitFor(entry.hash, 0), entries);
+        m_count = 1;
+        return;
+    }
+
+    bool added = false;
+    m_root = assocIn(m_root, true, 0, entry, added);
+    m_count += added ? 1 : 0;
+}
+
+void HashTrie::erase(const malValuePtr& key)
+{
+    if (!m_root) {
+        return;
+    }
+
+    bool removed = false;
+    if (m_root->isArray()) {
+        int index = arrayIndex(m_root.ptr(), key);
+        if (index < 0) {
+            return;
+        }
+        removed = true;
+        m_root = removeEntry(m_root, m_root->isUnique(), 0, index);
+    }
+    else {
+        m_root = dissocIn(m_root, true, 0, hashKey(key), key, removed);
+    }
+    m_count -= removed ? 1 : 0;
+}
+
+HashTrie::iterator::iterator(const HashNode* root)
+{
+    if (root) {
+        Position position = { root, 0 };
+        m_stack.push_back(position);
+        settle();
+    }
+}
+
+// Moves down to the next key/value entry, or up and along from the end of
+// a node.
+void HashTrie::iterator::settle()
+{
+    while (!m_stack.empty()) {
+        Position& top = m_stack.back();
+        if (top.index == top.node->m_entries.size()) {
+            m_stack.pop_back();
+            if (!m_stack.empty()) {
+                ++m_stack.back().index;
+            }
+            continue;
+        }
+        const HashEntry& entry = top.node->m_entries[top.index];
+        if (!entry.child) {
+            return;
+        }
+        Position position = { entry.child.ptr(), 0 };
+        m_stack.push_back(position);
+    }
+}
@@ -0,0 +1,127 @@
+#ifndef INCLUDE_HASHTRIE_H
+#define INCLUDE_HASHTRIE_H
+
+#include "MAL.h"
+
+#include <vector>
+
+class HashNode;
+typedef RefCountedPtr<HashNode> HashNodePtr;
+
+// Each entry is either a key and its value, or a sub-trie for all of the
+// keys whose hashes share this entry's bits.
+struct HashEntry {
+    size_t      hash;
+    malValuePtr key;
+    malValuePtr value;
+    HashNodePtr child;
+};
+typedef std::vector<HashEntry, PoolAllocator<HashEntry> > HashEntryVec;
+
+class HashNode : public RefCounted {
+public:
+    // Bitmap nodes hold an entry for each bit set in the bitmap. The others
+    // are searched linearly: collision nodes hold keys whose hashes are all
+    // the same, and array nodes hold all of a small map's keys, in the
+    // order they were added, without hashing them at all.
+    enum Kind { Bitmap, Collision, Array };
+
+    HashNode(Kind kind, uint32_t bitmap, HashEntryVec& entries);
+
+    bool isBitmap() const    { return m_kind == Bitmap; }
+    bool isCollision() const { return m_kind == Collision; }
+    bool isArray() const     { return m_kind == Array; }
+
+    virtual void visitChildren(Visitor& visitor) const;
+
+    static void* operator new(size_t size) {
+        return Allocator::allocate(size);
+    }
+    static void operator delete(void* p, size_t size) {
+        Allocator::deallocate(p, size);
+    }
+
+    // These are only changed while nothing else refers to the node.
+    const Kind   m_kind;
+    uint32_t     m_bitmap;
+    HashEntryVec m_entries;
+};
+
+// A persistent hash map: a hash array mapped trie, branching on five bits
+// of the key's hash at each level, with each node only holding the
+// entries which are present. Updates copy the path down to the changed
+// entry, and share everything else with the original.
+//
+// Maps of up to ArrayLimit keys are just an array node, which is smaller,
+// and quicker to search than hashing the key.
+class HashTrie {
+public:
+    static const int Bits = 5;
+    static const int ArrayLimit = 8;
+
+    HashTrie() : m_count(0) { }
+
+    int count() const { return m_count; }
+    bool isEmpty() const { return m_count == 0; }
+
+    // Returns NULL if key isn't present.
+    const malValuePtr* find(const malValuePtr& key) const;
+
+    HashTrie assoc(const malValuePtr& key, const malValuePtr& value) const;
+    HashTrie dissoc(const malValuePtr& key) const;
+
+    // Like assoc and dissoc, but change this trie, only copying the nodes
+    // which are shared with another trie, and updating the rest in place.
+    void set(const malValuePtr& key, const malValuePtr& value);
+    void erase(const malValuePtr& key);
+
+    // Visits the key/value entries in hash order.
+    class iterator {
+    public:
+        const HashEntry& operator * () const {
+            return m_stack.back().node->m_entries[m_stack.back().index];
+        }
+        const HashEntry* operator -> () const { return &**this; }
+
+        iterator& operator ++ () {
+            ++m_stack.back().index;
+            settle();
+            return *this;
+        }
+
+        bool operator != (const iterator& that) const {
+            if (m_stack.empty() || that.m_stack.empty()) {
+                return m_stack.empty() != that.m_stack.empty();
+            }
+            return m_stack.back().node != that.m_stack.back().node ||
+                   m_stack.back().index != that.m_stack.back().index;
+        }
+
+    private:
+        friend class HashTrie;
+        struct Position {
+            const HashNode* node;
+            size_t          index;
+        };
+
+        iterator() { }
+        explicit iterator(const HashNode* root);
+        void settle();
+
+        std::vector<Position> m_stack;
+    };
+
+    iterator begin() const { return iterator(m_root.ptr()); }
+    iterator end() const { return iterator(); }
+
+    bool mayBeCyclic() const { return m_root && m_root->mayBeCyclic(); }
+    void visit(RefCounted::Visitor& visitor) const { m_root.visit(visitor); }
+
+private:
+    void setHashed(const malValuePtr& key, const malValuePtr& value);
+
+    HashNodePtr m_root;
+    int         m_count;
+};
+
+#endif // INCLUDE_HASHTRIE_H
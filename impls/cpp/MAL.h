@@ -1,6 +1,7 @@
 #ifndef INCLUDE_MAL_H
 #define INCLUDE_MAL_H
 
+#include "Allocator.h"
 #include "Debug.h"
 #include "RefCountedPtr.h"
 #include "String.h"
@@ -10,14 +11,21 @@
 
 class malValue;
 typedef RefCountedPtr<malValue>  malValuePtr;
-typedef std::vector<malValuePtr> malValueVec;
-typedef malValueVec::iterator    malValueIter;
+typedef std::vector<malValuePtr, PoolAllocator<malValuePtr> > malValueVec;
+typedef malValuePtr*             malValueIter;
+
+class malSequence;
+class malSymbol;
+typedef std::vector<const malSymbol*> malSymbolVec;
 
 class malEnv;
 typedef RefCountedPtr<malEnv>     malEnvPtr;
 
 // step*.cpp
-extern malValuePtr APPLY(malValuePtr op,
+// Builtins may change an argument in place if nothing else refers to it,
+// so the arguments must be references held for the call, and never the
+// items of a sequence which is still in use.
+extern malValuePtr APPLY(const malValuePtr& op,
                          malValueIter argsBegin, malValueIter argsEnd);
 extern malValuePtr EVAL(malValuePtr ast, malEnvPtr env);
 extern malValuePtr readline(const String& prompt);
@@ -28,5 +36,6 @@ extern void installCore(malEnvPtr env);
 
 // Reader.cpp
 extern malValuePtr readStr(const String& input);
+extern void setHashConsing(bool enabled);
 
 #endif // INCLUDE_MAL_H
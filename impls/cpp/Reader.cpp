@@ -1,7 +1,10 @@
 #include "MAL.h"
 #include "Types.h"
 
+#include <algorithm>
 #include <regex>
+#include <typeinfo>
+#include <unordered_set>
 
 typedef std::regex              Regex;
 
@@ -11,6 +14,7 @@ static const Regex closeRegex("[\\)\\]}]");
 static const Regex whitespaceRegex("[\\s,]+|;.*");
 static const Regex tokenRegexes[] = {
     Regex("~@"),
+    Regex("#\\{"),
     Regex("[\\[\\]{}()'`~^@]"),
     Regex("\"(?:\\\\.|[^\\\\\"])*\""),
     Regex("[^\\s\\[\\]{}('\"`,;)]+"),
@@ -112,6 +116,86 @@ void Tokeniser::skipWhitespace()
     }
 }
 
+// When hash-consing, each value read is replaced by the first equal value
+// of the same type that was read from the same input, so repeated forms
+// and literals share a single instance, and comparing them is just a
+// pointer comparison. Since everything read is immutable, and the table
+// only lasts as long as the read, nothing can tell the difference except
+// by identity.
+class HashConsTable
+{
+public:
+    malValuePtr share(const malValuePtr& value) {
+        if (value.isTagged()) {
+            return value;
+        }
+        return *m_values.insert(value).first;
+    }
+
+private:
+    struct Hash {
+        size_t operator () (const malValuePtr& value) const {
+            return mal::hashValue(value);
+        }
+    };
+    // Children have already been shared, so two values are the same if
+    // they have the same type and the very same children. Comparing them
+    // with mal::isEqual would also match a list with a vector below the
+    // top level.
+    struct Equal {
+        bool operator () (const malValuePtr& lhs,
+                          const malValuePtr& rhs) const {
+            if (typeid(*lhs.ptr()) != typeid(*rhs.ptr())) {
+                return false;
+            }
+            if (const malSequence* l = DYNAMIC_CAST(malSequence, lhs)) {
+                const malSequence* r = STATIC_CAST(malSequence, rhs);
+                return (l->count() == r->count()) &&
+                       std::equal(l->begin(), l->end(), r->begin());
+            }
+            if (const malHash* l = DYNAMIC_CAST(malHash, lhs)) {
+                return sameEntries(l->map(),
+                                   STATIC_CAST(malHash, rhs)->map());
+            }
+            if (const malSet* l = DYNAMIC_CAST(malSet, lhs)) {
+                return sameEntries(l->items(),
+                                   STATIC_CAST(malSet, rhs)->items());
+            }
+            return mal::isEqual(lhs, rhs);
+        }
+
+        // Only matches entries in the same order, which is enough for
+        // equal maps read the same way.
+        static bool sameEntries(const HashTrie& lhs, const HashTrie& rhs) {
+            if (lhs.count() != rhs.count()) {
+                return false;
+            }
+            for (auto l = lhs.begin(), r = rhs.begin(), end = lhs.end();
+                 l != end; ++l, ++r) {
+                if ((l->key != r->key) || (l->value != r->value)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+    };
+
+    std::unordered_set<malValuePtr, Hash, Equal> m_values;
+};
+
+static bool s_isHashConsing = false;
+static HashConsTable* s_hashCons = NULL;
+
+void setHashConsing(bool enabled)
+{
+    s_isHashConsing = enabled;
+}
+
+static malValuePtr share(malValuePtr value)
+{
+    return s_hashCons ? s_hashCons->share(value) : value;
+}
+
 static malValuePtr readAtom(Tokeniser& tokeniser);
 static malValuePtr readForm(Tokeniser& tokeniser);
 static void readList(Tokeniser& tokeniser, malValueVec* items,
@@ -124,6 +208,15 @@ malValuePtr readStr(const String& input)
     if (tokeniser.eof()) {
         throw malEmptyInputException();
     }
+    if (!s_isHashConsing) {
+        return readForm(tokeniser);
+    }
+
+    HashConsTable table;
+    struct Scope {
+        Scope(HashConsTable* table)  { s_hashCons = table; }
+        ~Scope()                     { s_hashCons = NULL; }
+    } scope(&table);
     return readForm(tokeniser);
 }
 
@@ -139,19 +232,27 @@ static malValuePtr readForm(Tokeniser& tokeniser)
         tokeniser.next();
         std::unique_ptr<malValueVec> items(new malValueVec);
         readList(tokeniser, items.get(), ")");
-        return mal::list(items.release());
+        return share(mal::list(items.release()));
     }
     if (token == "[") {
         tokeniser.next();
         std::unique_ptr<malValueVec> items(new malValueVec);
         readList(tokeniser, items.get(), "]");
-        return mal::vector(items.release());
+        return share(mal::vector(items.release()));
     }
     if (token == "{") {
         tokeniser.next();
         malValueVec items;
         readList(tokeniser, &items, "}");
-        return mal::hash(items.begin(), items.end(), false);
+        return share(mal::hash(items.data(), items.data() + items.size(),
+                               false));
+    }
+    if (token == "#{") {
+        tokeniser.next();
+        malValueVec items;
+        readList(tokeniser, &items, "}");
+        return share(mal::set(items.data(), items.data() + items.size(),
+                              false));
     }
     return readAtom(tokeniser);
 }
@@ -182,7 +283,7 @@ static malValuePtr readAtom(Tokeniser& tokeniser)
 
     String token = tokeniser.next();
     if (token[0] == '"') {
-        return mal::string(unescape(token));
+        return share(mal::string(unescape(token)));
     }
     if (token[0] == ':') {
         return mal::keyword(token);
@@ -191,7 +292,7 @@ static malValuePtr readAtom(Tokeniser& tokeniser)
         malValuePtr meta = readForm(tokeniser);
         malValuePtr value = readForm(tokeniser);
         // Note that meta and value switch places
-        return mal::list(mal::symbol("with-meta"), value, meta);
+        return share(mal::list(mal::symbol(SYM_WITH_META), value, meta));
     }
     for (auto &constant : constantTable) {
         if (token == constant.token) {
@@ -204,7 +305,7 @@ static malValuePtr readAtom(Tokeniser& tokeniser)
         }
     }
     if (std::regex_match(token, intRegex)) {
-        return mal::integer(token);
+        return share(mal::integer(token));
     }
     return mal::symbol(token);
 }
@@ -224,5 +325,5 @@ static void readList(Tokeniser& tokeniser, malValueVec* items,
 
 static malValuePtr processMacro(Tokeniser& tokeniser, const String& symbol)
 {
-    return mal::list(mal::symbol(symbol), readForm(tokeniser));
+    return share(mal::list(mal::symbol(symbol), readForm(tokeniser)));
 }
@@ -0,0 +1,357 @@
+#include "RefCountedPtr.h"
+
+#if !MAL_GC // see TracingGC.cpp
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+typedef std::vector<const RefCounted*> RefCountedQueue;
+
+int RefCounted::s_reclaimBudget = 0;
+
+static const int MinPruneLimit     = 10000;
+static const int MinCycleThreshold = 10000;
+static const int MaxCycleThreshold = 1 << 20;
+
+// This is deliberately never freed, as objects can still be released by
+// static destructors after the thread-locals have gone.
+static thread_local RefCountedQueue* s_queue = NULL;
+static thread_local bool s_isDestroying = false;
+
+static RefCountedQueue& queue()
+{
+    if (s_queue == NULL) {
+        s_queue = new RefCountedQueue;
+    }
+    return *s_queue;
+}
+
+void RefCounted::destroy(const RefCounted* object)
+{
+    // A buffered object is left for the cycle collector to delete, as it
+    // still has a pointer to it.
+    if (object->m_isBuffered) {
+        object->m_color = Black;
+        return;
+    }
+
+    if (s_isDestroying || (s_reclaimBudget > 0)) {
+        queue().push_back(object);
+        return;
+    }
+
+    s_isDestroying = true;
+    delete object;
+    if (s_queue != NULL) {
+        while (!s_queue->empty()) {
+            const RefCounted* next = s_queue->back();
+            s_queue->pop_back();
+            delete next;
+        }
+    }
+    s_isDestroying = false;
+}
+
+void RefCounted::reclaimQueued(int budget)
+{
+    if (s_isDestroying || (s_queue == NULL)) {
+        return;
+    }
+
+    s_isDestroying = true;
+    for (int i = 0; (budget <= 0 || i < budget) && !s_queue->empty(); i++) {
+        const RefCounted* next = s_queue->back();
+        s_queue->pop_back();
+        delete next;
+    }
+    s_isDestroying = false;
+}
+
+void RefCounted::setReclaimBudget(int budget)
+{
+    s_reclaimBudget = budget;
+    if (budget <= 0) {
+        reclaimQueued(0);
+    }
+}
+
+// Like the queue, the roots are never freed.
+static thread_local RefCountedQueue* s_roots = NULL;
+static thread_local int s_pruneLimit = MinPruneLimit;
+static thread_local int s_cycleThreshold = MinCycleThreshold;
+static thread_local int s_collections = 0;
+static thread_local int64_t s_freed = 0;
+static thread_local int64_t s_pauseMicros = 0;
+static thread_local int64_t s_maxPauseMicros = 0;
+
+void RefCounted::possibleRoot() const
+{
+    if (m_color != Purple) {
+        m_color = Purple;
+        if (!m_isBuffered) {
+            m_isBuffered = true;
+            if (s_roots == NULL) {
+                s_roots = new RefCountedQueue;
+            }
+            s_roots->push_back(this);
+        }
+    }
+}
+
+// The four phases of the synchronous collector from the paper, with the
+// recursion replaced by explicit stacks so that long chains of objects
+// don't overflow the C++ stack. The counts are decremented along every
+// internal edge of the subgraph reachable from the roots; anything left
+// with a count of zero is referenced only from inside that subgraph.
+// Immortal objects can't be garbage, so they're left out altogether.
+class CycleCollector {
+public:
+    // Returns the number of objects traced.
+    static int markGray(const RefCounted* root) {
+        RefCountedQueue stack(1, root);
+        DecrementVisitor visitor(stack);
+        int traced = 0;
+        while (!stack.empty()) {
+            const RefCounted* object = stack.back();
+            stack.pop_back();
+            if (object->m_color != RefCounted::Gray) {
+                object->m_color = RefCounted::Gray;
+                object->visitChildren(visitor);
+                traced++;
+            }
+        }
+        return traced;
+    }
+
+    static void scan(const RefCounted* root) {
+        RefCountedQueue stack(1, root);
+        PushVisitor visitor(stack);
+        while (!stack.empty()) {
+            const RefCounted* object = stack.back();
+            stack.pop_back();
+            if (object->m_color == RefCounted::Gray) {
+                if (object->m_refCount > 0) {
+                    scanBlack(object);
+                }
+                else {
+                    object->m_color = RefCounted::White;
+                    object->visitChildren(visitor);
+                }
+            }
+        }
+    }
+
+    static void scanBlack(const RefCounted* root) {
+        RefCountedQueue stack(1, root);
+        IncrementVisitor visitor(stack);
+        root->m_color = RefCounted::Black;
+        while (!stack.empty()) {
+            const RefCounted* object = stack.back();
+            stack.pop_back();
+            object->visitChildren(visitor);
+        }
+    }
+
+    static void collectWhite(const RefCounted* root, RefCountedQueue& garbage) {
+        RefCountedQueue stack(1, root);
+        PushVisitor visitor(stack);
+        while (!stack.empty()) {
+            const RefCounted* object = stack.back();
+            stack.pop_back();
+            if ((object->m_color == RefCounted::White) &&
+                !object->m_isBuffered) {
+                object->m_color = RefCounted::Black;
+                garbage.push_back(object);
+                object->visitChildren(visitor);
+            }
+        }
+    }
+
+    // Puts back the counts for the edges out of the garbage, so that the
+    // objects can be freed by dropping references in the normal way.
+    static void restore(const RefCountedQueue& garbage) {
+        RestoreVisitor visitor;
+        for (auto it = garbage.begin(), end = garbage.end(); it != end; ++it) {
+            (*it)->visitChildren(visitor);
+        }
+    }
+
+    // Most buffered objects die soon afterwards, and are left in the buffer
+    // until this drops them. It's cheap compared to a collection, as it
+    // doesn't trace anything.
+    static void pruneRoots() {
+        RefCountedQueue roots, dead;
+        roots.swap(*s_roots);
+        auto live = std::partition(roots.begin(), roots.end(), isLiveRoot);
+        for (auto it = live; it != roots.end(); ++it) {
+            (*it)->m_isBuffered = false;
+            if ((*it)->m_refCount == 0) {
+                dead.push_back(*it);
+            }
+        }
+        roots.erase(live, roots.end());
+        roots.swap(*s_roots);
+
+        for (auto it = dead.begin(), end = dead.end(); it != end; ++it) {
+            RefCounted::destroy(*it);
+        }
+    }
+
+    static void unbuffer(const RefCounted* object) {
+        object->m_isBuffered = false;
+    }
+
+    // Garbage objects are coloured purple while they're being freed, which
+    // stops them being buffered again as their counts drop.
+    static void free(const RefCountedQueue& garbage) {
+        for (auto it = garbage.begin(), end = garbage.end(); it != end; ++it) {
+            (*it)->acquire();
+            (*it)->m_color = RefCounted::Purple;
+        }
+        for (auto it = garbage.begin(), end = garbage.end(); it != end; ++it) {
+            const_cast<RefCounted*>(*it)->clearReferences();
+        }
+        for (auto it = garbage.begin(), end = garbage.end(); it != end; ++it) {
+            (*it)->m_color = RefCounted::Black;
+            if ((*it)->release() == 0) {
+                RefCounted::destroy(*it);
+            }
+        }
+    }
+
+private:
+    static bool isLiveRoot(const RefCounted* object) {
+        return (object->m_color == RefCounted::Purple) &&
+               (object->m_refCount > 0);
+    }
+
+    class PushVisitor : public RefCounted::Visitor {
+    public:
+        PushVisitor(RefCountedQueue& stack) : m_stack(stack) { }
+        virtual void visit(const RefCounted* child) {
+            if (!child->isImmortal()) {
+                m_stack.push_back(child);
+            }
+        }
+    private:
+        RefCountedQueue& m_stack;
+    };
+
+    class DecrementVisitor : public RefCounted::Visitor {
+    public:
+        DecrementVisitor(RefCountedQueue& stack) : m_stack(stack) { }
+        virtual void visit(const RefCounted* child) {
+            if (child->isImmortal()) {
+                return;
+            }
+            child->m_refCount--;
+            if (child->m_color != RefCounted::Gray) {
+                m_stack.push_back(child);
+            }
+        }
+    private:
+        RefCountedQueue& m_stack;
+    };
+
+    class IncrementVisitor : public RefCounted::Visitor {
+    public:
+        IncrementVisitor(RefCountedQueue& stack) : m_stack(stack) { }
+        virtual void visit(const RefCounted* child) {
+            if (child->isImmortal()) {
+                return;
+            }
+            child->m_refCount++;
+            if (child->m_color != RefCounted::Black) {
+                child->m_color = RefCounted::Black;
+                m_stack.push_back(child);
+            }
+        }
+    private:
+        RefCountedQueue& m_stack;
+    };
+
+    class RestoreVisitor : public RefCounted::Visitor {
+    public:
+        virtual void visit(const RefCounted* child) {
+            if (!child->isImmortal()) {
+                child->m_refCount++;
+            }
+        }
+    };
+};
+
+void RefCounted::reclaim()
+{
+    if (s_reclaimBudget > 0) {
+        reclaimQueued(s_reclaimBudget);
+    }
+    if ((s_roots != NULL) && ((int)s_roots->size() > s_pruneLimit)) {
+        CycleCollector::pruneRoots();
+        if ((int)s_roots->size() > s_cycleThreshold) {
+            collectCycles();
+        }
+        s_pruneLimit = std::max(MinPruneLimit, (int)s_roots->size() * 2);
+    }
+}
+
+int RefCounted::collectCycles()
+{
+    if (s_isDestroying || (s_roots == NULL)) {
+        return 0;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    // Anything buffered while the garbage is being freed goes into a new
+    // buffer, to be looked at next time.
+    CycleCollector::pruneRoots();
+    RefCountedQueue roots, garbage;
+    roots.swap(*s_roots);
+
+    int traced = 0;
+    for (auto it = roots.begin(), end = roots.end(); it != end; ++it) {
+        traced += CycleCollector::markGray(*it);
+    }
+    for (auto it = roots.begin(), end = roots.end(); it != end; ++it) {
+        CycleCollector::scan(*it);
+    }
+    for (auto it = roots.begin(), end = roots.end(); it != end; ++it) {
+        CycleCollector::unbuffer(*it);
+        CycleCollector::collectWhite(*it, garbage);
+    }
+
+    CycleCollector::restore(garbage);
+    CycleCollector::free(garbage);
+
+    // Each collection traces everything live which is reachable from the
+    // roots, which can be most of the heap, so wait for at least that many
+    // candidates before the next one. This keeps the cost per candidate
+    // constant.
+    int freed = garbage.size();
+    s_cycleThreshold = std::min(std::max(traced - freed, MinCycleThreshold),
+                                MaxCycleThreshold);
+    s_collections++;
+    s_freed += freed;
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    s_pauseMicros += elapsed;
+    s_maxPauseMicros = std::max<int64_t>(s_maxPauseMicros, elapsed);
+    return freed;
+}
+
+RefCounted::CycleStats RefCounted::cycleStats()
+{
+    CycleStats stats;
+    stats.collections    = s_collections;
+    stats.freed          = s_freed;
+    stats.candidates     = (s_roots != NULL) ? s_roots->size() : 0;
+    stats.threshold      = s_cycleThreshold;
+    stats.pauseMicros    = s_pauseMicros;
+    stats.maxPauseMicros = s_maxPauseMicros;
+    stats.queued         = (s_queue != NULL) ? s_queue->size() : 0;
+    return stats;
+}
+
+#endif // !MAL_GC
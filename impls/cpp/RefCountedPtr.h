@@ -4,23 +4,232 @@
 #include "Debug.h"
 
 #include <cstddef>
+#include <cstdint>
+#include <utility>
 
+#if DEBUG_REFCOUNT_STATS
+    // Counts every write to a reference count, reported on exit.
+    struct RefCountStats {
+        uint64_t acquires;
+        uint64_t releases;
+
+        ~RefCountStats() {
+            TRACE("refcount: %llu acquires, %llu releases\n",
+                  (unsigned long long)acquires,
+                  (unsigned long long)releases);
+        }
+    };
+
+    inline RefCountStats& refCountStats() {
+        static RefCountStats stats;
+        return stats;
+    }
+
+    #define COUNT_REFCOUNT_OP(op)   (refCountStats().op++)
+#else
+    #define COUNT_REFCOUNT_OP(op)   NOOP
+#endif
+
+// Building with MAL_GC (see the mal-gc target) replaces reference counting
+// with a mark-sweep collector. RefCountedPtr then becomes a plain pointer,
+// and every object is kept on a list which the collector sweeps. The roots
+// are the objects which have been acquire()d explicitly, such as interned
+// symbols, and any pointers registered with GC_ROOT. Collections only
+// happen in reclaim() and collectCycles(), so only values which are held
+// outside the heap across a call to EVAL need registering.
 class RefCounted {
 public:
-    RefCounted() : m_refCount(0) { }
+#if MAL_GC
+    RefCounted();
+    virtual ~RefCounted() { }
+
+    // Pins the object, so it is never collected.
+    const RefCounted* acquire() const {
+        m_isPinned = true;
+        return this;
+    }
+    void makeImmortal() const { m_isPinned = true; }
+
+    // Without counts there's no knowing what else refers to an object.
+    bool isUnique() const { return false; }
+#else
+    RefCounted()
+    : m_refCount(0), m_color(Black), m_isBuffered(false), m_mayBeCyclic(false)
+    { }
     virtual ~RefCounted() { }
 
-    const RefCounted* acquire() const { m_refCount++; return this; }
-    int release() const { return --m_refCount; }
+    const RefCounted* acquire() const {
+        if (m_refCount != Immortal) {
+            COUNT_REFCOUNT_OP(acquires);
+            m_refCount++;
+        }
+        return this;
+    }
+    int release() const {
+        if (m_refCount == Immortal) {
+            return Immortal;
+        }
+        COUNT_REFCOUNT_OP(releases);
+        return --m_refCount;
+    }
     int refCount() const { return m_refCount; }
 
+    // True if only one pointer refers to this object, so whatever holds
+    // that pointer can change the object without anything else seeing.
+    bool isUnique() const { return m_refCount == 1; }
+
+    // Objects which are never freed, such as nil, the builtins and the
+    // interned symbols, are made immortal. Their counts are never written
+    // again, which saves a great deal of traffic on the most shared values,
+    // and leaves their pages clean. They must not be part of any cycle.
+    void makeImmortal() const { m_refCount = Immortal; }
+    bool isImmortal() const { return m_refCount == Immortal; }
+
+    // Dead objects are handed to destroy() rather than deleted directly.
+    // Any objects which die while it's deleting one are queued rather than
+    // deleted recursively, so dropping a long list or a deeply nested
+    // structure takes constant stack.
+    static void destroy(const RefCounted* object);
+#endif
+
+    // With a budget set, destroy() only queues objects, and reclaim(),
+    // which EVAL calls once per step, destroys at most that many of them.
+    // This bounds the pause caused by dropping a large structure. With no
+    // budget (the default) everything is destroyed straight away. It also
+    // runs the cycle collector once enough candidates have been buffered.
+    static void setReclaimBudget(int budget);
+    static void reclaim();
+
+    // Reference counting alone can't free cycles, such as a closure stored
+    // in the environment it closes over, or an atom which contains itself.
+    // Objects which can be part of a cycle call setMayBeCyclic(), and
+    // report the objects they refer to through visitChildren(). Whenever
+    // the count of such an object drops to a non-zero value it's buffered
+    // as a possible root of a garbage cycle, and collectCycles() does a
+    // trial deletion from those roots (Bacon & Rajan, "Concurrent Cycle
+    // Collection in Reference Counted Systems").
+    class Visitor {
+    public:
+        virtual ~Visitor() { }
+        virtual void visit(const RefCounted* child) = 0;
+    };
+    virtual void visitChildren(Visitor& visitor) const { }
+
+    // Every cycle passes through at least one mutable object, so the
+    // collector frees a garbage cycle by having its mutable objects drop
+    // their references, and lets reference counting do the rest.
+    virtual void clearReferences() { }
+
+    // With MAL_GC, candidates are the objects allocated since the last
+    // collection.
+    struct CycleStats {
+        int     collections;    // Number of collections run
+        int64_t freed;          // Objects freed by the collector
+        int     candidates;     // Possible roots currently buffered
+        int     threshold;      // Candidates which trigger a collection
+        int64_t pauseMicros;    // Total time spent collecting
+        int64_t maxPauseMicros; // Longest single collection
+        int     queued;         // Dead objects waiting to be destroyed
+    };
+
+    // Returns the number of objects freed.
+    static int collectCycles();
+    static CycleStats cycleStats();
+
+#if MAL_GC
+    bool mayBeCyclic() const { return false; }
+    void setMayBeCyclic() { }
+
+    // A pointer or container of pointers held outside the heap. These are
+    // kept on a stack, so must be declared as locals, through GC_ROOT.
+    class Root {
+    public:
+        template<class T>
+        Root(const T& value)
+        : m_value(&value), m_visit(&visitRoot<T>), m_next(s_roots) {
+            s_roots = this;
+        }
+        ~Root() { s_roots = m_next; }
+
+    private:
+        friend class Collector;
+
+        template<class T>
+        static void visitRoot(const void* value, Visitor& visitor) {
+            visitValue(*static_cast<const T*>(value), visitor);
+        }
+
+        template<class T>
+        static void visitValue(const T& ptr, Visitor& visitor) {
+            ptr.visit(visitor);
+        }
+        template<class T, class U>
+        static void visitValue(const std::pair<T, U>& pair, Visitor& visitor) {
+            visitValue(pair.first, visitor);
+            visitValue(pair.second, visitor);
+        }
+        template<class T, class A, template<class, class> class C>
+        static void visitValue(const C<T, A>& items, Visitor& visitor) {
+            for (auto it = items.begin(), end = items.end(); it != end; ++it) {
+                visitValue(*it, visitor);
+            }
+        }
+        template<class K, class V, class H, class E, class A,
+                 template<class, class, class, class, class> class M>
+        static void visitValue(const M<K, V, H, E, A>& items,
+                               Visitor& visitor) {
+            for (auto it = items.begin(), end = items.end(); it != end; ++it) {
+                visitValue(*it, visitor);
+            }
+        }
+
+        const void* const m_value;
+        void (* const m_visit)(const void*, Visitor&);
+        Root* const m_next;
+    };
+
 private:
+    friend class Collector;
+
+    static thread_local Root* s_roots;
+
+    RefCounted(const RefCounted&); // no copy ctor
+    RefCounted& operator = (const RefCounted&); // no assignments
+
+    RefCounted* m_next;
+    mutable bool m_isMarked;
+    mutable bool m_isPinned;
+};
+
+#define GC_ROOT_NAME(line)      GC_ROOT_NAME2(line)
+#define GC_ROOT_NAME2(line)     gcRoot##line
+#define GC_ROOT(value)          RefCounted::Root GC_ROOT_NAME(__LINE__)(value)
+#else
+    bool mayBeCyclic() const { return m_mayBeCyclic; }
+    void setMayBeCyclic() { m_mayBeCyclic = true; }
+    void possibleRoot() const;
+
+private:
+    friend class CycleCollector;
+
+    enum Color { Black, Gray, White, Purple };
+    static const int Immortal = INT32_MAX;
+
+    static void reclaimQueued(int budget);
+    static int s_reclaimBudget;
+
     RefCounted(const RefCounted&); // no copy ctor
     RefCounted& operator = (const RefCounted&); // no assignments
 
     mutable int m_refCount;
+    mutable unsigned char m_color;
+    mutable bool m_isBuffered;
+    bool m_mayBeCyclic;
 };
 
+#define GC_ROOT(value)          NOOP
+#endif
+
 template<class T>
 class RefCountedPtr {
 public:
@@ -32,11 +241,38 @@ public:
     RefCountedPtr(const RefCountedPtr& rhs) : m_object(0)
     { acquire(rhs.m_object); }
 
+    // Moving just transfers ownership, so the count is left alone.
+    RefCountedPtr(RefCountedPtr&& rhs) : m_object(rhs.m_object)
+    { rhs.m_object = 0; }
+
+    // A pointer with the low bit set doesn't refer to an object, but holds
+    // an immediate value in its remaining bits. These are never acquired,
+    // released or dereferenced.
+    static RefCountedPtr fromBits(intptr_t bits) {
+        return RefCountedPtr(reinterpret_cast<T*>(bits));
+    }
+
+    static bool isTagged(const T* object) {
+        return (reinterpret_cast<intptr_t>(object) & 1) != 0;
+    }
+
+    bool isTagged() const { return isTagged(m_object); }
+    intptr_t bits() const { return reinterpret_cast<intptr_t>(m_object); }
+
     const RefCountedPtr& operator = (const RefCountedPtr& rhs) {
         acquire(rhs.m_object);
         return *this;
     }
 
+    const RefCountedPtr& operator = (RefCountedPtr&& rhs) {
+        // Detach rhs first, as releasing our object may destroy rhs.
+        T* object = rhs.m_object;
+        rhs.m_object = 0;
+        release();
+        m_object = object;
+        return *this;
+    }
+
     bool operator == (const RefCountedPtr& rhs) const {
         return m_object == rhs.m_object;
     }
@@ -56,9 +292,19 @@ public:
     T* operator -> () const { return m_object; }
     T* ptr() const { return m_object; }
 
+    void visit(RefCounted::Visitor& visitor) const {
+        if ((m_object != NULL) && !isTagged(m_object)) {
+            visitor.visit(m_object);
+        }
+    }
+
 private:
+#if MAL_GC
+    void acquire(T* object) { m_object = object; }
+    void release() { }
+#else
     void acquire(T* object) {
-        if (object != NULL) {
+        if ((object != NULL) && !isTagged(object)) {
             object->acquire();
         }
         release();
@@ -66,10 +312,16 @@ private:
     }
 
     void release() {
-        if ((m_object != NULL) && (m_object->release() == 0)) {
-            delete m_object;
+        if ((m_object != NULL) && !isTagged(m_object)) {
+            if (m_object->release() == 0) {
+                RefCounted::destroy(m_object);
+            }
+            else if (m_object->mayBeCyclic()) {
+                m_object->possibleRoot();
+            }
         }
     }
+#endif
 
     T* m_object;
 };
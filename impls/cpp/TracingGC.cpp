@@ -0,0 +1,138 @@
+#include "RefCountedPtr.h"
+
+#if MAL_GC
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+typedef std::vector<const RefCounted*> RefCountedStack;
+
+static const int MinCollectThreshold = 100000;
+
+thread_local RefCounted::Root* RefCounted::s_roots = NULL;
+
+static thread_local RefCounted* s_heap = NULL;
+static thread_local int s_heapCount = 0;
+static thread_local int s_allocated = 0;
+static thread_local int s_collectThreshold = MinCollectThreshold;
+static thread_local int s_collections = 0;
+static thread_local int64_t s_freed = 0;
+static thread_local int64_t s_pauseMicros = 0;
+static thread_local int64_t s_maxPauseMicros = 0;
+static thread_local bool s_isCollecting = false;
+
+RefCounted::RefCounted()
+: m_next(s_heap), m_isMarked(false), m_isPinned(false)
+{
+    s_heap = this;
+    s_heapCount++;
+    s_allocated++;
+}
+
+void RefCounted::setReclaimBudget(int budget)
+{
+    // Nothing is freed outside a collection, so there's nothing to spread.
+}
+
+void RefCounted::reclaim()
+{
+    if (s_allocated > s_collectThreshold) {
+        collectCycles();
+    }
+}
+
+class Collector {
+public:
+    static void mark() {
+        RefCountedStack stack;
+        MarkVisitor visitor(stack);
+        for (RefCounted* object = s_heap; object; object = object->m_next) {
+            if (object->m_isPinned) {
+                visitor.visit(object);
+            }
+        }
+        for (RefCounted::Root* root = RefCounted::s_roots; root;
+             root = root->m_next) {
+            root->m_visit(root->m_value, visitor);
+        }
+        while (!stack.empty()) {
+            const RefCounted* object = stack.back();
+            stack.pop_back();
+            object->visitChildren(visitor);
+        }
+    }
+
+    // Returns the number of objects freed.
+    static int sweep() {
+        int freed = 0;
+        RefCounted** link = &s_heap;
+        while (RefCounted* object = *link) {
+            if (object->m_isMarked) {
+                object->m_isMarked = false;
+                link = &object->m_next;
+            }
+            else {
+                *link = object->m_next;
+                delete object;
+                freed++;
+            }
+        }
+        return freed;
+    }
+
+private:
+    class MarkVisitor : public RefCounted::Visitor {
+    public:
+        MarkVisitor(RefCountedStack& stack) : m_stack(stack) { }
+        virtual void visit(const RefCounted* object) {
+            if (!object->m_isMarked) {
+                object->m_isMarked = true;
+                m_stack.push_back(object);
+            }
+        }
+    private:
+        RefCountedStack& m_stack;
+    };
+};
+
+int RefCounted::collectCycles()
+{
+    if (s_isCollecting) {
+        return 0;
+    }
+    s_isCollecting = true;
+    auto start = std::chrono::steady_clock::now();
+
+    Collector::mark();
+    int freed = Collector::sweep();
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    s_pauseMicros += elapsed;
+    s_maxPauseMicros = std::max<int64_t>(s_maxPauseMicros, elapsed);
+
+    // Let the heap double before collecting again.
+    s_heapCount -= freed;
+    s_allocated = 0;
+    s_collectThreshold = std::max(s_heapCount, MinCollectThreshold);
+    s_collections++;
+    s_freed += freed;
+    s_isCollecting = false;
+    return freed;
+}
+
+RefCounted::CycleStats RefCounted::cycleStats()
+{
+    CycleStats stats;
+    stats.collections    = s_collections;
+    stats.freed          = s_freed;
+    stats.candidates     = s_allocated;
+    stats.threshold      = s_collectThreshold;
+    stats.pauseMicros    = s_pauseMicros;
+    stats.maxPauseMicros = s_maxPauseMicros;
+    stats.queued         = 0;
+    return stats;
+}
+
+#endif // MAL_GC
@@ -5,13 +5,24 @@
 #include <algorithm>
 #include <memory>
 #include <typeinfo>
+#include <unordered_map>
+
+static malKeyword* internKeyword(const String& name);
+static malSymbol* internSymbol(const String& name);
+
+static malConstant* constant(const char* name, bool isTrue)
+{
+    malConstant* c = new malConstant(name, isTrue);
+    c->makeImmortal();
+    return c;
+}
 
 namespace mal {
     malValuePtr atom(malValuePtr value) {
-        return malValuePtr(new malAtom(value));
+        return malValuePtr(new malAtom(std::move(value)));
     };
 
-    malValuePtr boolean(bool value) {
+    const malValuePtr& boolean(bool value) {
         return value ? trueValue() : falseValue();
     }
 
@@ -19,9 +30,13 @@ namespace mal {
         return malValuePtr(new malBuiltIn(name, handler));
     };
 
-    malValuePtr falseValue() {
-        static malValuePtr c(new malConstant("false"));
-        return malValuePtr(c);
+    malValuePtr cons(malValuePtr first, malValuePtr rest) {
+        return malValuePtr(new malList(std::move(first), std::move(rest)));
+    }
+
+    const malValuePtr& falseValue() {
+        static malValuePtr c(constant("false", false));
+        return c;
     };
 
 
@@ -34,110 +49,142 @@ namespace mal {
         return malValuePtr(new malHash(argsBegin, argsEnd, isEvaluated));
     }
 
-    malValuePtr integer(int64_t value) {
-        return malValuePtr(new malInteger(value));
-    };
-
     malValuePtr integer(const String& token) {
-        return integer(std::stoi(token));
+        return integer(std::stoll(token));
     };
 
     malValuePtr keyword(const String& token) {
-        return malValuePtr(new malKeyword(token));
+        return malValuePtr(internKeyword(token));
     };
 
-    malValuePtr lambda(const StringVec& bindings,
+    malValuePtr lambda(const malSymbolVec& bindings,
                        malValuePtr body, malEnvPtr env) {
-        return malValuePtr(new malLambda(bindings, body, env));
+        return malValuePtr(new malLambda(bindings, std::move(body),
+                                         std::move(env)));
     }
 
     malValuePtr list(malValueVec* items) {
-        return malValuePtr(new malList(items));
+        return malValuePtr(new (items->size()) malList(items));
     };
 
     malValuePtr list(malValueIter begin, malValueIter end) {
-        return malValuePtr(new malList(begin, end));
+        return malValuePtr(new (end - begin) malList(begin, end));
     };
 
     malValuePtr list(malValuePtr a) {
-        malValueVec* items = new malValueVec(1);
-        items->at(0) = a;
-        return malValuePtr(new malList(items));
+        return malValuePtr(new (1) malList(&a, &a + 1));
     }
 
     malValuePtr list(malValuePtr a, malValuePtr b) {
-        malValueVec* items = new malValueVec(2);
-        items->at(0) = a;
-        items->at(1) = b;
-        return malValuePtr(new malList(items));
+        malValuePtr items[] = { std::move(a), std::move(b) };
+        return malValuePtr(new (2) malList(items, items + 2));
     }
 
     malValuePtr list(malValuePtr a, malValuePtr b, malValuePtr c) {
-        malValueVec* items = new malValueVec(3);
-        items->at(0) = a;
-        items->at(1) = b;
-        items->at(2) = c;
-        return malValuePtr(new malList(items));
+        malValuePtr items[] = { std::move(a), std::move(b), std::move(c) };
+        return malValuePtr(new (3) malList(items, items + 3));
     }
 
     malValuePtr macro(const malLambda& lambda) {
         return malValuePtr(new malLambda(lambda, true));
     };
 
-    malValuePtr nilValue() {
-        static malValuePtr c(new malConstant("nil"));
-        return malValuePtr(c);
+    const malValuePtr& nilValue() {
+        static malValuePtr c(constant("nil", false));
+        return c;
     };
 
+    malValuePtr set(malValueIter argsBegin, malValueIter argsEnd,
+                    bool isEvaluated) {
+        return malValuePtr(new malSet(argsBegin, argsEnd, isEvaluated));
+    }
+
+    malValuePtr set(const malSet::Items& items) {
+        return malValuePtr(new malSet(items));
+    }
+
     malValuePtr string(const String& token) {
         return malValuePtr(new malString(token));
     }
 
     malValuePtr symbol(const String& token) {
-        return malValuePtr(new malSymbol(token));
+        return malValuePtr(internSymbol(token));
+    };
+
+    malValuePtr symbol(malSymbolId id) {
+        return malValuePtr(malSymbol::fromId(id));
     };
 
-    malValuePtr trueValue() {
-        static malValuePtr c(new malConstant("true"));
-        return malValuePtr(c);
+    const malValuePtr& trueValue() {
+        static malValuePtr c(constant("true", true));
+        return c;
     };
 
     malValuePtr vector(malValueVec* items) {
-        return malValuePtr(new malVector(items));
+        return malValuePtr(new (items->size()) malVector(items));
     };
 
     malValuePtr vector(malValueIter begin, malValueIter end) {
-        return malValuePtr(new malVector(begin, end));
+        return malValuePtr(new (end - begin) malVector(begin, end));
     };
 };
 
+namespace mal {
+    malValuePtr eval(const malValuePtr& ast, const malEnvPtr& env) {
+        return ast.isTagged() ? ast : ast->eval(env);
+    }
+
+    bool isEqual(const malValuePtr& lhs, const malValuePtr& rhs) {
+        if (lhs.isTagged() || rhs.isTagged()) {
+            return isInteger(lhs) && isInteger(rhs)
+                && (integerValue(lhs) == integerValue(rhs));
+        }
+        return lhs->isEqualTo(rhs.ptr());
+    }
+
+    size_t hashValue(const malValuePtr& value) {
+        return value.isTagged() ? std::hash<int64_t>()(integerValue(value))
+                                : value->hash();
+    }
+
+    bool isTrue(const malValuePtr& value) {
+        return value.isTagged() || value->isTrue();
+    }
+
+    malValuePtr meta(const malValuePtr& value) {
+        return value.isTagged() ? nilValue() : value->meta();
+    }
+
+    String print(const malValuePtr& value, bool readably) {
+        if (value.isTagged()) {
+            return std::to_string(integerValue(value));
+        }
+        return value->print(readably);
+    }
+
+    malValuePtr withMeta(const malValuePtr& value, malValuePtr meta) {
+        if (value.isTagged()) {
+            return malValuePtr(new malInteger(integerValue(value),
+                                              std::move(meta)));
+        }
+        return value->withMeta(std::move(meta));
+    }
+};
+
 malValuePtr malBuiltIn::apply(malValueIter argsBegin,
                               malValueIter argsEnd) const
 {
     return m_handler(m_name, argsBegin, argsEnd);
 }
 
-static String makeHashKey(malValuePtr key)
-{
-    if (const malString* skey = DYNAMIC_CAST(malString, key)) {
-        return skey->print(true);
-    }
-    else if (const malKeyword* kkey = DYNAMIC_CAST(malKeyword, key)) {
-        return kkey->print(true);
-    }
-    MAL_FAIL("%s is not a string or keyword", key->print(true).c_str());
-}
-
-static malHash::Map addToMap(malHash::Map& map,
+static void addToMap(malHash::Map& map,
     malValueIter argsBegin, malValueIter argsEnd)
 {
     // This is intended to be called with pre-evaluated arguments.
     for (auto it = argsBegin; it != argsEnd; ++it) {
-        String key = makeHashKey(*it++);
-        map[key] = *it;
+        const malValuePtr& key = *it++;
+        map.set(key, *it);
     }
-
-    return map;
 }
 
 static malHash::Map createMap(malValueIter argsBegin, malValueIter argsEnd)
@@ -146,21 +193,31 @@ static malHash::Map createMap(malValueIter argsBegin, malValueIter argsEnd)
             "hash-map requires an even-sized list");
 
     malHash::Map map;
-    return addToMap(map, argsBegin, argsEnd);
+    addToMap(map, argsBegin, argsEnd);
+    return map;
 }
 
 malHash::malHash(malValueIter argsBegin, malValueIter argsEnd, bool isEvaluated)
 : m_map(createMap(argsBegin, argsEnd))
 , m_isEvaluated(isEvaluated)
+, m_hash(0)
 {
-
+    inheritMayBeCyclic();
 }
 
 malHash::malHash(const malHash::Map& map)
 : m_map(map)
 , m_isEvaluated(true)
+, m_hash(0)
 {
+    inheritMayBeCyclic();
+}
 
+void malHash::inheritMayBeCyclic()
+{
+    if (m_map.mayBeCyclic()) {
+        setMayBeCyclic();
+    }
 }
 
 malValuePtr
@@ -170,13 +227,27 @@ malHash::assoc(malValueIter argsBegin, malValueIter argsEnd) const
             "assoc requires an even-sized list");
 
     malHash::Map map(m_map);
-    return mal::hash(addToMap(map, argsBegin, argsEnd));
+    addToMap(map, argsBegin, argsEnd);
+    return mal::hash(map);
+}
+
+bool malHash::assocInPlace(malValueIter argsBegin, malValueIter argsEnd)
+{
+    if (!isUnique() || !m_isEvaluated) {
+        return false;
+    }
+    MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
+            "assoc requires an even-sized list");
+
+    addToMap(m_map, argsBegin, argsEnd);
+    m_hash = 0;
+    inheritMayBeCyclic();
+    return true;
 }
 
 bool malHash::contains(malValuePtr key) const
 {
-    auto it = m_map.find(makeHashKey(key));
-    return it != m_map.end();
+    return m_map.find(key) != NULL;
 }
 
 malValuePtr
@@ -184,42 +255,51 @@ malHash::dissoc(malValueIter argsBegin, malValueIter argsEnd) const
 {
     malHash::Map map(m_map);
     for (auto it = argsBegin; it != argsEnd; ++it) {
-        String key = makeHashKey(*it);
-        map.erase(key);
+        map.erase(*it);
     }
     return mal::hash(map);
 }
 
-malValuePtr malHash::eval(malEnvPtr env)
+bool malHash::dissocInPlace(malValueIter argsBegin, malValueIter argsEnd)
+{
+    if (!isUnique() || !m_isEvaluated) {
+        return false;
+    }
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        m_map.erase(*it);
+    }
+    m_hash = 0;
+    return true;
+}
+
+malValuePtr malHash::eval(const malEnvPtr& env)
 {
     if (m_isEvaluated) {
         return malValuePtr(this);
     }
 
     malHash::Map map;
+    GC_ROOT(map);
     for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
-        map[it->first] = EVAL(it->second, env);
+        malValuePtr key = EVAL(it->key, env);
+        GC_ROOT(key);
+        map.set(key, EVAL(it->value, env));
     }
     return mal::hash(map);
 }
 
 malValuePtr malHash::get(malValuePtr key) const
 {
-    auto it = m_map.find(makeHashKey(key));
-    return it == m_map.end() ? mal::nilValue() : it->second;
+    const malValuePtr* value = m_map.find(key);
+    return value ? *value : mal::nilValue();
 }
 
 malValuePtr malHash::keys() const
 {
     malValueVec* keys = new malValueVec();
-    keys->reserve(m_map.size());
+    keys->reserve(m_map.count());
     for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
-        if (it->first[0] == '"') {
-            keys->push_back(mal::string(unescape(it->first)));
-        }
-        else {
-            keys->push_back(mal::keyword(it->first));
-        }
+        keys->push_back(it->key);
     }
     return mal::list(keys);
 }
@@ -227,9 +307,9 @@ malValuePtr malHash::keys() const
 malValuePtr malHash::values() const
 {
     malValueVec* keys = new malValueVec();
-    keys->reserve(m_map.size());
+    keys->reserve(m_map.count());
     for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
-        keys->push_back(it->second);
+        keys->push_back(it->value);
     }
     return mal::list(keys);
 }
@@ -240,11 +320,13 @@ String malHash::print(bool readably) const
 
     auto it = m_map.begin(), end = m_map.end();
     if (it != end) {
-        s += it->first + " " + it->second->print(readably);
+        s += mal::print(it->key, readably) + " " +
+             mal::print(it->value, readably);
         ++it;
     }
     for ( ; it != end; ++it) {
-        s += " " + it->first + " " + it->second->print(readably);
+        s += " " + mal::print(it->key, readably) + " " +
+             mal::print(it->value, readably);
     }
 
     return s + "}";
@@ -253,51 +335,275 @@ String malHash::print(bool readably) const
 bool malHash::doIsEqualTo(const malValue* rhs) const
 {
     const malHash::Map& r_map = static_cast<const malHash*>(rhs)->m_map;
-    if (m_map.size() != r_map.size()) {
+    if (m_map.count() != r_map.count()) {
         return false;
     }
 
-    for (auto it0 = m_map.begin(), end0 = m_map.end(), it1 = r_map.begin();
-         it0 != end0; ++it0, ++it1) {
-
-        if (it0->first != it1->first) {
+    for (auto it0 = m_map.begin(), end0 = m_map.end(); it0 != end0; ++it0) {
+        const malValuePtr* value = r_map.find(it0->key);
+        if (!value) {
             return false;
         }
-        if (!it0->second->isEqualTo(it1->second.ptr())) {
+        if (!mal::isEqual(it0->value, *value)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t malHash::hash() const
+{
+    // Summing the entries' hashes makes this independent of their order.
+    if (m_hash == 0) {
+        size_t hash = 0;
+        for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
+            hash += mal::hashValue(it->key) * 31 + mal::hashValue(it->value);
+        }
+        m_hash = hash ? hash : 1;
+    }
+    return m_hash;
+}
+
+void malHash::visitChildren(Visitor& visitor) const
+{
+    malValue::visitChildren(visitor);
+    m_map.visit(visitor);
+}
+
+static void addToSet(malSet::Items& items,
+    malValueIter argsBegin, malValueIter argsEnd)
+{
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        items.set(*it, mal::nilValue());
+    }
+}
+
+static malSet::Items createSet(malValueIter argsBegin, malValueIter argsEnd)
+{
+    malSet::Items items;
+    addToSet(items, argsBegin, argsEnd);
+    return items;
+}
+
+malSet::malSet(malValueIter argsBegin, malValueIter argsEnd, bool isEvaluated)
+: m_items(createSet(argsBegin, argsEnd))
+, m_isEvaluated(isEvaluated)
+, m_hash(0)
+{
+    inheritMayBeCyclic();
+}
+
+malSet::malSet(const malSet::Items& items)
+: m_items(items)
+, m_isEvaluated(true)
+, m_hash(0)
+{
+    inheritMayBeCyclic();
+}
+
+void malSet::inheritMayBeCyclic()
+{
+    if (m_items.mayBeCyclic()) {
+        setMayBeCyclic();
+    }
+}
+
+malValuePtr malSet::conj(malValueIter argsBegin, malValueIter argsEnd) const
+{
+    malSet::Items items(m_items);
+    addToSet(items, argsBegin, argsEnd);
+    return mal::set(items);
+}
+
+malValuePtr malSet::disj(malValueIter argsBegin, malValueIter argsEnd) const
+{
+    malSet::Items items(m_items);
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        items.erase(*it);
+    }
+    return mal::set(items);
+}
+
+bool malSet::conjInPlace(malValueIter argsBegin, malValueIter argsEnd)
+{
+    if (!isUnique() || !m_isEvaluated) {
+        return false;
+    }
+    addToSet(m_items, argsBegin, argsEnd);
+    m_hash = 0;
+    inheritMayBeCyclic();
+    return true;
+}
+
+bool malSet::disjInPlace(malValueIter argsBegin, malValueIter argsEnd)
+{
+    if (!isUnique() || !m_isEvaluated) {
+        return false;
+    }
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        m_items.erase(*it);
+    }
+    m_hash = 0;
+    return true;
+}
+
+malValuePtr malSet::unionWith(const malSet* that) const
+{
+    const malSet* larger  = (count() >= that->count()) ? this : that;
+    const malSet* smaller = (larger == this) ? that : this;
+
+    malSet::Items items(larger->m_items);
+    for (auto it = smaller->m_items.begin(), end = smaller->m_items.end();
+         it != end; ++it) {
+        items.set(it->key, it->value);
+    }
+    return mal::set(items);
+}
+
+malValuePtr malSet::intersection(const malSet* that) const
+{
+    const malSet* larger  = (count() >= that->count()) ? this : that;
+    const malSet* smaller = (larger == this) ? that : this;
+
+    malSet::Items items;
+    for (auto it = smaller->m_items.begin(), end = smaller->m_items.end();
+         it != end; ++it) {
+        if (larger->contains(it->key)) {
+            items.set(it->key, it->value);
+        }
+    }
+    return mal::set(items);
+}
+
+malValuePtr malSet::difference(const malSet* that) const
+{
+    malSet::Items items;
+    if (that->count() < count()) {
+        items = m_items;
+        for (auto it = that->m_items.begin(), end = that->m_items.end();
+             it != end; ++it) {
+            items.erase(it->key);
+        }
+    }
+    else {
+        for (auto it = m_items.begin(), end = m_items.end(); it != end; ++it) {
+            if (!that->contains(it->key)) {
+                items.set(it->key, it->value);
+            }
+        }
+    }
+    return mal::set(items);
+}
+
+bool malSet::contains(const malValuePtr& item) const
+{
+    return m_items.find(item) != NULL;
+}
+
+malValuePtr malSet::eval(const malEnvPtr& env)
+{
+    if (m_isEvaluated) {
+        return malValuePtr(this);
+    }
+
+    malSet::Items items;
+    GC_ROOT(items);
+    for (auto it = m_items.begin(), end = m_items.end(); it != end; ++it) {
+        items.set(EVAL(it->key, env), mal::nilValue());
+    }
+    return mal::set(items);
+}
+
+malValuePtr malSet::seq() const
+{
+    malValueVec* items = new malValueVec();
+    items->reserve(m_items.count());
+    for (auto it = m_items.begin(), end = m_items.end(); it != end; ++it) {
+        items->push_back(it->key);
+    }
+    return mal::list(items);
+}
+
+String malSet::print(bool readably) const
+{
+    String s = "#{";
+
+    auto it = m_items.begin(), end = m_items.end();
+    if (it != end) {
+        s += mal::print(it->key, readably);
+        ++it;
+    }
+    for ( ; it != end; ++it) {
+        s += " " + mal::print(it->key, readably);
+    }
+
+    return s + "}";
+}
+
+bool malSet::doIsEqualTo(const malValue* rhs) const
+{
+    const malSet::Items& r_items = static_cast<const malSet*>(rhs)->m_items;
+    if (m_items.count() != r_items.count()) {
+        return false;
+    }
+
+    for (auto it = m_items.begin(), end = m_items.end(); it != end; ++it) {
+        if (!r_items.find(it->key)) {
             return false;
         }
     }
     return true;
 }
 
-malLambda::malLambda(const StringVec& bindings,
+size_t malSet::hash() const
+{
+    // As with maps, summing makes this independent of the order.
+    if (m_hash == 0) {
+        size_t hash = 0;
+        for (auto it = m_items.begin(), end = m_items.end(); it != end; ++it) {
+            hash += mal::hashValue(it->key);
+        }
+        m_hash = hash ? hash : 1;
+    }
+    return m_hash;
+}
+
+void malSet::visitChildren(Visitor& visitor) const
+{
+    malValue::visitChildren(visitor);
+    m_items.visit(visitor);
+}
+
+malLambda::malLambda(const malSymbolVec& bindings,
                      malValuePtr body, malEnvPtr env)
 : m_bindings(bindings)
-, m_body(body)
-, m_env(env)
+, m_body(std::move(body))
+, m_env(std::move(env))
 , m_isMacro(false)
 {
-
+    // The environment can now reach itself, if this gets bound in it.
+    setMayBeCyclic();
+    m_env->setMayBeCyclic();
 }
 
 malLambda::malLambda(const malLambda& that, malValuePtr meta)
-: malApplicable(meta)
+: malApplicable(std::move(meta))
 , m_bindings(that.m_bindings)
 , m_body(that.m_body)
 , m_env(that.m_env)
 , m_isMacro(that.m_isMacro)
 {
-
+    setMayBeCyclic();
 }
 
 malLambda::malLambda(const malLambda& that, bool isMacro)
-: malApplicable(that.m_meta)
+: malApplicable(that.ownMeta())
 , m_bindings(that.m_bindings)
 , m_body(that.m_body)
 , m_env(that.m_env)
 , m_isMacro(isMacro)
 {
-
+    setMayBeCyclic();
 }
 
 malValuePtr malLambda::apply(malValueIter argsBegin,
@@ -308,7 +614,125 @@ malValuePtr malLambda::apply(malValueIter argsBegin,
 
 malValuePtr malLambda::doWithMeta(malValuePtr meta) const
 {
-    return new malLambda(*this, meta);
+    return new malLambda(*this, std::move(meta));
+}
+
+void malLambda::visitChildren(Visitor& visitor) const
+{
+    malValue::visitChildren(visitor);
+    m_body.visit(visitor);
+    m_env.visit(visitor);
+}
+
+void malAtom::visitChildren(Visitor& visitor) const
+{
+    malValue::visitChildren(visitor);
+    m_value.visit(visitor);
+}
+
+void malAtom::clearReferences()
+{
+    m_value = malValuePtr();
+}
+
+malTransient::malTransient(const VectorTrie& vector)
+: m_isVector(true)
+, m_isEditable(true)
+, m_vector(vector)
+{
+    setMayBeCyclic();
+}
+
+malTransient::malTransient(const malHash::Map& map)
+: m_isVector(false)
+, m_isEditable(true)
+, m_map(map)
+{
+    setMayBeCyclic();
+}
+
+void malTransient::checkEditable() const
+{
+    MAL_CHECK(m_isEditable, "Transient used after persistent!");
+}
+
+void malTransient::conj(malValueIter argsBegin, malValueIter argsEnd)
+{
+    checkEditable();
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        if (m_isVector) {
+            m_vector.push(*it);
+            continue;
+        }
+        const malSequence* entry = VALUE_CAST(malSequence, *it);
+        MAL_CHECK(entry->count() == 2, "conj! on a map requires pairs");
+        m_map.set(entry->item(0), entry->item(1));
+    }
+}
+
+void malTransient::assoc(malValueIter argsBegin, malValueIter argsEnd)
+{
+    checkEditable();
+    MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
+            "assoc! requires an even-sized list");
+
+    for (auto it = argsBegin; it != argsEnd; it += 2) {
+        if (m_isVector) {
+            int64_t index = mal::integerValue(*it);
+            MAL_CHECK(0 <= index && index <= m_vector.count(),
+                      "Index out of range");
+            m_vector.set(index, it[1]);
+        }
+        else {
+            m_map.set(it[0], it[1]);
+        }
+    }
+}
+
+void malTransient::dissoc(malValueIter argsBegin, malValueIter argsEnd)
+{
+    checkEditable();
+    MAL_CHECK(!m_isVector, "dissoc! requires a transient map");
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        m_map.erase(*it);
+    }
+}
+
+malValuePtr malTransient::persistent()
+{
+    checkEditable();
+    m_isEditable = false;
+
+    // Hand the nodes over, so that nothing else refers to them.
+    malValuePtr result;
+    if (m_isVector) {
+        result = new malVector(m_vector);
+        m_vector = VectorTrie();
+    }
+    else {
+        result = mal::hash(m_map);
+        m_map = malHash::Map();
+    }
+    return result;
+}
+
+String malTransient::print(bool readably) const
+{
+    return STRF(m_isVector ? "#transient-vector(%p)" : "#transient-map(%p)",
+                this);
+}
+
+void malTransient::visitChildren(Visitor& visitor) const
+{
+    malValue::visitChildren(visitor);
+    m_vector.visit(visitor);
+    m_map.visit(visitor);
+}
+
+void malTransient::clearReferences()
+{
+    m_vector = VectorTrie();
+    m_map = malHash::Map();
 }
 
 malEnvPtr malLambda::makeEnv(malValueIter argsBegin, malValueIter argsEnd) const
@@ -316,20 +740,67 @@ malEnvPtr malLambda::makeEnv(malValueIter argsBegin, malValueIter argsEnd) const
     return malEnvPtr(new malEnv(m_env, m_bindings, argsBegin, argsEnd));
 }
 
+malEnvPtr malLambda::makeEnv(const malSequence* args) const
+{
+    return malEnvPtr(new malEnv(m_env, m_bindings,
+                                args->begin(), args->end(), args));
+}
+
+malList::malList(malValuePtr first, malValuePtr rest)
+: malSequence(STATIC_CAST(malList, rest)->count() + 1, malValuePtr())
+, m_first(std::move(first))
+, m_rest(std::move(rest))
+{
+    malValue::inheritMayBeCyclic(m_first);
+    malValue::inheritMayBeCyclic(m_rest);
+}
+
 malValuePtr malList::conj(malValueIter argsBegin,
                           malValueIter argsEnd) const
 {
-    int oldItemCount = std::distance(begin(), end());
-    int newItemCount = std::distance(argsBegin, argsEnd);
+    malValuePtr list(const_cast<malList*>(this));
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        list = mal::cons(*it, list);
+    }
+    return list;
+}
 
-    malValueVec* items = new malValueVec(oldItemCount + newItemCount);
-    std::reverse_copy(argsBegin, argsEnd, items->begin());
-    std::copy(begin(), end(), items->begin() + newItemCount);
+malValuePtr malList::rest() const
+{
+    return isCell() ? m_rest : malSequence::rest();
+}
 
-    return mal::list(items);
+const malValuePtr& malList::lookup(int index) const
+{
+    const malList* list = this;
+    while (list->isCell() && (index > 0)) {
+        list = STATIC_CAST(malList, list->m_rest);
+        --index;
+    }
+    return list->isCell() ? list->m_first : list->item(index);
 }
 
-malValuePtr malList::eval(malEnvPtr env)
+malValueVec* malList::flatten() const
+{
+    malValueVec* items = new malValueVec;
+    items->reserve(count());
+    const malList* list = this;
+    while (list->isCell()) {
+        items->push_back(list->m_first);
+        list = STATIC_CAST(malList, list->m_rest);
+    }
+    items->insert(items->end(), list->begin(), list->end());
+    return items;
+}
+
+void malList::visitChildren(Visitor& visitor) const
+{
+    malSequence::visitChildren(visitor);
+    m_first.visit(visitor);
+    m_rest.visit(visitor);
+}
+
+malValuePtr malList::eval(const malEnvPtr& env)
 {
     // Note, this isn't actually called since the TCO updates, but
     // is required for the earlier steps, so don't get rid of it.
@@ -338,9 +809,10 @@ malValuePtr malList::eval(malEnvPtr env)
     }
 
     std::unique_ptr<malValueVec> items(evalItems(env));
-    auto it = items->begin();
+    GC_ROOT(*items);
+    auto it = items->data();
     malValuePtr op = *it;
-    return APPLY(op, ++it, items->end());
+    return APPLY(op, ++it, items->data() + items->size());
 }
 
 String malList::print(bool readably) const
@@ -348,7 +820,7 @@ String malList::print(bool readably) const
     return '(' + malSequence::print(readably) + ')';
 }
 
-malValuePtr malValue::eval(malEnvPtr env)
+malValuePtr malValue::eval(const malEnvPtr& env)
 {
     // Default case of eval is just to return the object itself.
     return malValuePtr(this);
@@ -356,6 +828,10 @@ malValuePtr malValue::eval(malEnvPtr env)
 
 bool malValue::isEqualTo(const malValue* rhs) const
 {
+    if (this == rhs) {
+        return true;
+    }
+
     // Special-case. Vectors and Lists can be compared.
     bool matchingTypes = (typeid(*this) == typeid(*rhs)) ||
         (dynamic_cast<const malSequence*>(this) &&
@@ -364,44 +840,181 @@ bool malValue::isEqualTo(const malValue* rhs) const
     return matchingTypes && doIsEqualTo(rhs);
 }
 
-bool malValue::isTrue() const
+typedef std::unordered_map<const malValue*, malValuePtr> malMetaTable;
+
+// This is deliberately never freed, as values can still be destroyed by
+// static destructors after it would have gone.
+static malMetaTable& metaTable()
 {
-    return (this != mal::falseValue().ptr())
-        && (this != mal::nilValue().ptr());
+    static malMetaTable* table = new malMetaTable;
+    return *table;
+}
+
+malValue::malValue(malValuePtr meta)
+: m_hasMeta(meta.ptr() != NULL)
+{
+    TRACE_OBJECT("Creating malValue %p\n", this);
+    if (m_hasMeta) {
+        inheritMayBeCyclic(meta);
+        metaTable()[this] = std::move(meta);
+    }
+}
+
+void malValue::eraseMeta()
+{
+    // Move the metadata out first, so that the table isn't being changed
+    // while releasing it destroys anything else.
+    auto it = metaTable().find(this);
+    malValuePtr meta = std::move(it->second);
+    metaTable().erase(it);
 }
 
 malValuePtr malValue::meta() const
 {
-    return m_meta.ptr() == NULL ? mal::nilValue() : m_meta;
+    return m_hasMeta ? metaTable().find(this)->second : mal::nilValue();
+}
+
+malValuePtr malValue::ownMeta() const
+{
+    return m_hasMeta ? metaTable().find(this)->second : malValuePtr();
+}
+
+void malValue::visitChildren(Visitor& visitor) const
+{
+    if (m_hasMeta) {
+        metaTable().find(this)->second.visit(visitor);
+    }
 }
 
 malValuePtr malValue::withMeta(malValuePtr meta) const
 {
-    return doWithMeta(meta);
+    return doWithMeta(std::move(meta));
 }
 
-malSequence::malSequence(malValueVec* items)
-: m_items(items)
+// The allocated size is kept just before the object, as the size passed
+// to operator delete doesn't include the items.
+void* malSequence::allocate(size_t size, int count)
 {
+    size_t total = sizeof(size_t) + size + count * sizeof(malValuePtr);
+    size_t* block = static_cast<size_t*>(Allocator::allocate(total));
+    *block = total;
+    return block + 1;
+}
 
+void malSequence::operator delete(void* p)
+{
+    size_t* block = static_cast<size_t*>(p) - 1;
+    Allocator::deallocate(block, *block);
 }
 
-malSequence::malSequence(malValueIter begin, malValueIter end)
-: m_items(new malValueVec(begin, end))
+malSequence::malSequence(malValuePtr* storage,
+                         malValueIter begin, malValueIter end)
+: m_items(storage)
+, m_flattened(NULL)
+, m_count(end - begin)
+, m_hash(0)
 {
+    for (int i = 0; i < m_count; i++) {
+        new (&m_items[i]) malValuePtr(begin[i]);
+    }
+    inheritMayBeCyclic();
+}
 
+malSequence::malSequence(malValuePtr* storage, malValueVec* items)
+: m_items(storage)
+, m_flattened(NULL)
+, m_count(items->size())
+, m_hash(0)
+{
+    for (int i = 0; i < m_count; i++) {
+        new (&m_items[i]) malValuePtr(std::move((*items)[i]));
+    }
+    delete items;
+    inheritMayBeCyclic();
 }
 
+// Copies share the items with the original, as a slice of all of them.
+// Sequences which don't have their items yet have their own way of
+// sharing them.
 malSequence::malSequence(const malSequence& that, malValuePtr meta)
-: malValue(meta)
-, m_items(new malValueVec(*(that.m_items)))
+: malValue(std::move(meta))
+, m_items(that.m_items)
+, m_flattened(NULL)
+, m_source(m_items ? malValuePtr(const_cast<malSequence*>(that.owner()))
+                   : malValuePtr())
+, m_count(that.m_count)
+, m_hash(that.m_hash)
+{
+    if (that.mayBeCyclic()) {
+        setMayBeCyclic();
+    }
+}
+
+malSequence::malSequence(int count, malValuePtr meta)
+: malValue(std::move(meta))
+, m_items(NULL)
+, m_flattened(NULL)
+, m_count(count)
+, m_hash(0)
 {
 
 }
 
+malSequence::malSequence(const malSequence* source, int offset)
+: m_items(source->items() + offset)
+, m_flattened(NULL)
+, m_source(const_cast<malSequence*>(source->owner()))
+, m_count(source->count() - offset)
+, m_hash(0)
+{
+    malValue::inheritMayBeCyclic(m_source);
+}
+
+void malSequence::updated(int count)
+{
+    delete m_flattened;
+    m_flattened = NULL;
+    m_items = NULL;
+    m_count = count;
+    m_hash = 0;
+}
+
+// The sequence which holds the items that slices of this one should use.
+const malSequence* malSequence::owner() const
+{
+    return m_source ? STATIC_CAST(malSequence, m_source) : this;
+}
+
+const malValuePtr& malSequence::lookup(int index) const
+{
+    return items()[index];
+}
+
+malValueVec* malSequence::flatten() const
+{
+    return new malValueVec;
+}
+
+void malSequence::inheritMayBeCyclic()
+{
+    for (auto it = begin(), itEnd = end(); it != itEnd; ++it) {
+        malValue::inheritMayBeCyclic(*it);
+        if (mayBeCyclic()) {
+            break;
+        }
+    }
+}
+
 malSequence::~malSequence()
 {
-    delete m_items;
+    if (m_flattened) {
+        delete m_flattened;
+    }
+    else if (m_items && !m_source) {
+        for (int i = 0; i < m_count; i++) {
+            m_items[i].~malValuePtr();
+        }
+    }
 }
 
 bool malSequence::doIsEqualTo(const malValue* rhs) const
@@ -411,22 +1024,37 @@ bool malSequence::doIsEqualTo(const malValue* rhs) const
         return false;
     }
 
-    for (malValueIter it0 = m_items->begin(),
+    for (malValueIter it0 = begin(),
                       it1 = rhsSeq->begin(),
-                      end = m_items->end(); it0 != end; ++it0, ++it1) {
+                      end = this->end(); it0 != end; ++it0, ++it1) {
 
-        if (! (*it0)->isEqualTo((*it1).ptr())) {
+        if (!mal::isEqual(*it0, *it1)) {
             return false;
         }
     }
     return true;
 }
 
-malValueVec* malSequence::evalItems(malEnvPtr env) const
+size_t malSequence::hash() const
+{
+    // Lists and vectors with the same items are equal, so this must only
+    // depend on the items.
+    if (m_hash == 0) {
+        size_t hash = 1;
+        for (auto it = begin(), itEnd = end(); it != itEnd; ++it) {
+            hash = hash * 31 + mal::hashValue(*it);
+        }
+        m_hash = hash ? hash : 1;
+    }
+    return m_hash;
+}
+
+malValueVec* malSequence::evalItems(const malEnvPtr& env) const
 {
     malValueVec* items = new malValueVec;;
+    GC_ROOT(*items);
     items->reserve(count());
-    for (auto it = m_items->begin(), end = m_items->end(); it != end; ++it) {
+    for (auto it = begin(), itEnd = end(); it != itEnd; ++it) {
         items->push_back(EVAL(*it, env));
     }
     return items;
@@ -440,23 +1068,158 @@ malValuePtr malSequence::first() const
 String malSequence::print(bool readably) const
 {
     String str;
-    auto end = m_items->cend();
-    auto it = m_items->cbegin();
+    auto end = this->end();
+    auto it = begin();
     if (it != end) {
-        str += (*it)->print(readably);
+        str += mal::print(*it, readably);
         ++it;
     }
     for ( ; it != end; ++it) {
         str += " ";
-        str += (*it)->print(readably);
+        str += mal::print(*it, readably);
     }
     return str;
 }
 
 malValuePtr malSequence::rest() const
 {
-    malValueIter start = (count() > 0) ? begin() + 1 : end();
-    return mal::list(start, end());
+    return drop(1);
+}
+
+malValuePtr malSequence::drop(int n) const
+{
+    if (n >= count()) {
+        return mal::list(new malValueVec(0));
+    }
+    return malValuePtr(new malList(this, n));
+}
+
+void malSequence::visitChildren(Visitor& visitor) const
+{
+    malValue::visitChildren(visitor);
+    m_source.visit(visitor);
+    if (m_items && !m_source) {
+        for (int i = 0; i < m_count; i++) {
+            m_items[i].visit(visitor);
+        }
+    }
+}
+
+malStringBase::malStringBase(const malStringBase& that, malValuePtr meta)
+: malValue(std::move(meta))
+, m_source(const_cast<malStringBase*>(that.owner()))
+, m_offset(that.ownerOffset())
+, m_length(that.m_length)
+{
+
+}
+
+malStringBase::malStringBase(const malStringBase* source,
+                             size_t offset, size_t length)
+: m_source(const_cast<malStringBase*>(source->owner()))
+, m_offset(source->ownerOffset() + offset)
+, m_length(length)
+{
+
+}
+
+malStringBase::malStringBase(malValuePtr left, malValuePtr right)
+: m_source(std::move(left))
+, m_right(std::move(right))
+, m_offset(0)
+, m_length(source()->length() +
+           static_cast<const malStringBase*>(m_right.ptr())->length())
+{
+
+}
+
+const malStringBase* malStringBase::owner() const
+{
+    if (isRope()) {
+        flatten();
+    }
+    return m_source ? source() : this;
+}
+
+const String& malStringBase::sourceValue() const
+{
+    if (isRope()) {
+        flatten();
+        return m_value;
+    }
+    const String& text = source()->m_value;
+    if ((m_offset == 0) && (m_length == text.size())) {
+        return text;
+    }
+    m_value.assign(text, m_offset, m_length);
+    m_source = malValuePtr();
+    return m_value;
+}
+
+const char* malStringBase::sourceData() const
+{
+    if (isRope()) {
+        flatten();
+        return m_value.data();
+    }
+    return source()->m_value.data() + m_offset;
+}
+
+// Ropes built up a piece at a time are very lopsided, so walk them with an
+// explicit stack rather than recursing.
+void malStringBase::flatten() const
+{
+    String text;
+    text.reserve(m_length);
+    std::vector<const malStringBase*> stack;
+    stack.push_back(static_cast<const malStringBase*>(m_right.ptr()));
+    stack.push_back(source());
+    while (!stack.empty()) {
+        const malStringBase* s = stack.back();
+        stack.pop_back();
+        if (s->isRope()) {
+            stack.push_back(static_cast<const malStringBase*>(
+                                s->m_right.ptr()));
+            stack.push_back(s->source());
+        }
+        else {
+            text.append(s->data(), s->m_length);
+        }
+    }
+    m_value.swap(text);
+    m_source = malValuePtr();
+    m_right = malValuePtr();
+}
+
+void malStringBase::visitChildren(Visitor& visitor) const
+{
+    malValue::visitChildren(visitor);
+    m_source.visit(visitor);
+    m_right.visit(visitor);
+}
+
+malValuePtr malString::substring(size_t offset, size_t length) const
+{
+    return malValuePtr(new malString(this, offset, length));
+}
+
+malValuePtr malString::concat(const malValuePtr& lhs, const malValuePtr& rhs)
+{
+    const malString* l = STATIC_CAST(malString, lhs);
+    const malString* r = STATIC_CAST(malString, rhs);
+    if (l->length() + r->length() < RopeThreshold) {
+        return mal::string(l->value() + r->value());
+    }
+    return malValuePtr(new malString(lhs, rhs));
+}
+
+size_t malString::hash() const
+{
+    if (m_hash == 0) {
+        size_t hash = std::hash<String>()(value());
+        m_hash = hash ? hash : 1;
+    }
+    return m_hash;
 }
 
 String malString::escapedValue() const
@@ -469,25 +1232,162 @@ String malString::print(bool readably) const
     return readably ? escapedValue() : value();
 }
 
-malValuePtr malSymbol::eval(malEnvPtr env)
+malValuePtr malSymbol::eval(const malEnvPtr& env)
+{
+    return env->get(this);
+}
+
+static malKeyword* internKeyword(const String& name)
 {
-    return env->get(value());
+    static std::unordered_map<String, malKeyword*> table;
+
+    auto it = table.find(name);
+    if (it != table.end()) {
+        return it->second;
+    }
+    malKeyword* keyword = new malKeyword(name);
+    keyword->makeImmortal();
+    table[name] = keyword;
+    return keyword;
+}
+
+// These must be in the same order as malSymbolId.
+static const char* predefinedSymbols[] = {
+    "&",
+    "catch*",
+    "concat",
+    "cons",
+    "DEBUG-EVAL",
+    "def!",
+    "defmacro!",
+    "do",
+    "fn*",
+    "if",
+    "let*",
+    "quasiquote",
+    "quote",
+    "splice-unquote",
+    "try*",
+    "unquote",
+    "vec",
+    "with-meta",
+};
+
+class malSymbolTable {
+public:
+    malSymbolTable() {
+        for (auto name : predefinedSymbols) {
+            intern(name);
+        }
+    }
+
+    malSymbol* intern(const String& name) {
+        auto it = m_byName.find(name);
+        if (it != m_byName.end()) {
+            return it->second;
+        }
+        malSymbol* symbol = new malSymbol(name, m_byId.size());
+        symbol->makeImmortal();
+        m_byName[name] = symbol;
+        m_byId.push_back(symbol);
+        return symbol;
+    }
+
+    malSymbol* fromId(int id) const { return m_byId[id]; }
+
+private:
+    std::unordered_map<String, malSymbol*> m_byName;
+    std::vector<malSymbol*> m_byId;
+};
+
+static malSymbolTable& symbolTable()
+{
+    static malSymbolTable table;
+    return table;
+}
+
+static malSymbol* internSymbol(const String& name)
+{
+    return symbolTable().intern(name);
+}
+
+malSymbol* malSymbol::fromId(int id)
+{
+    return symbolTable().fromId(id);
+}
+
+malVector::malVector(const VectorTrie& trie)
+: malSequence(trie.count(), malValuePtr())
+, m_trie(trie)
+{
+    if (m_trie.mayBeCyclic()) {
+        setMayBeCyclic();
+    }
+}
+
+malValuePtr malVector::assoc(int index, malValuePtr value) const
+{
+    MAL_CHECK(0 <= index && index <= count(), "Index out of range");
+    return malValuePtr(new malVector(trie().assoc(index, value)));
 }
 
 malValuePtr malVector::conj(malValueIter argsBegin,
                             malValueIter argsEnd) const
 {
-    int oldItemCount = std::distance(begin(), end());
-    int newItemCount = std::distance(argsBegin, argsEnd);
+    VectorTrie items = trie();
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        items.push(*it);
+    }
+    return malValuePtr(new malVector(items));
+}
+
+bool malVector::conjInPlace(malValueIter argsBegin, malValueIter argsEnd)
+{
+    if (!canUpdate() || (m_trie.count() != count())) {
+        return false;
+    }
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        m_trie.push(*it);
+        malValue::inheritMayBeCyclic(*it);
+    }
+    updated(m_trie.count());
+    return true;
+}
+
+bool malVector::assocInPlace(int index, const malValuePtr& value)
+{
+    if (!canUpdate() || (m_trie.count() != count())) {
+        return false;
+    }
+    MAL_CHECK(0 <= index && index <= count(), "Index out of range");
+    m_trie.set(index, value);
+    malValue::inheritMayBeCyclic(value);
+    updated(m_trie.count());
+    return true;
+}
 
-    malValueVec* items = new malValueVec(oldItemCount + newItemCount);
-    std::copy(begin(), end(), items->begin());
-    std::copy(argsBegin, argsEnd, items->begin() + oldItemCount);
+const malValuePtr& malVector::lookup(int index) const
+{
+    return m_trie.item(index);
+}
 
-    return mal::vector(items);
+malValueVec* malVector::flatten() const
+{
+    return m_trie.flatten();
+}
+
+VectorTrie malVector::trie() const
+{
+    return (m_trie.count() == count()) ? m_trie : VectorTrie(begin(), end());
+}
+
+void malVector::visitChildren(Visitor& visitor) const
+{
+    malSequence::visitChildren(visitor);
+    m_trie.visit(visitor);
 }
 
-malValuePtr malVector::eval(malEnvPtr env)
+malValuePtr malVector::eval(const malEnvPtr& env)
 {
     return mal::vector(evalItems(env));
 }
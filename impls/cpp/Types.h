@@ -2,82 +2,143 @@
 #define INCLUDE_TYPES_H
 
 #include "MAL.h"
+#include "HashTrie.h"
+#include "VectorTrie.h"
 
 #include <exception>
-#include <map>
+#include <unordered_map>
+#include <utility>
 
 class malEmptyInputException : public std::exception { };
 
 class malValue : public RefCounted {
 public:
-    malValue() {
-        TRACE_OBJECT("Creating malValue %p\n", this);
-    }
-    malValue(malValuePtr meta) : m_meta(meta) {
+    malValue() : m_hasMeta(false) {
         TRACE_OBJECT("Creating malValue %p\n", this);
     }
+    malValue(malValuePtr meta);
     virtual ~malValue() {
         TRACE_OBJECT("Destroying malValue %p\n", this);
+        if (m_hasMeta) {
+            eraseMeta();
+        }
+    }
+
+    static void* operator new(size_t size) {
+        return Allocator::allocate(size);
+    }
+    static void operator delete(void* p, size_t size) {
+        Allocator::deallocate(p, size);
     }
 
     malValuePtr withMeta(malValuePtr meta) const;
     virtual malValuePtr doWithMeta(malValuePtr meta) const = 0;
     malValuePtr meta() const;
 
-    bool isTrue() const;
+    // Everything but nil and false.
+    virtual bool isTrue() const { return true; }
 
     bool isEqualTo(const malValue* rhs) const;
 
-    virtual malValuePtr eval(malEnvPtr env);
+    // Values which are equal must have the same hash. By default, values
+    // are only equal to themselves.
+    virtual size_t hash() const { return std::hash<const void*>()(this); }
+
+    virtual malValuePtr eval(const malEnvPtr& env);
 
     virtual String print(bool readably) const = 0;
 
+    virtual void visitChildren(Visitor& visitor) const;
+
 protected:
     virtual bool doIsEqualTo(const malValue* rhs) const = 0;
 
-    malValuePtr m_meta;
+    // Like meta(), but NULL rather than nil if there isn't any.
+    malValuePtr ownMeta() const;
+
+    // Immutable values can only be part of a cycle through something they
+    // refer to, so lists of numbers and symbols, such as most code, are
+    // never candidates for the cycle collector.
+    void inheritMayBeCyclic(const malValuePtr& child) {
+        if (child && !child.isTagged() && child->mayBeCyclic()) {
+            setMayBeCyclic();
+        }
+    }
+
+private:
+    void eraseMeta();
+
+    // Hardly any values have metadata, so rather than every value holding
+    // a pointer to it, it's kept in a side table, and this just says
+    // whether there's an entry there.
+    bool m_hasMeta;
+};
+
+// Integers may be stored directly in the malValuePtr rather than in a
+// malInteger (see mal::integer), so code which can be handed any value
+// must use these rather than calling the malValue methods directly.
+namespace mal {
+    malValuePtr eval(const malValuePtr& ast, const malEnvPtr& env);
+    bool        isEqual(const malValuePtr& lhs, const malValuePtr& rhs);
+    size_t      hashValue(const malValuePtr& value);
+    bool        isTrue(const malValuePtr& value);
+    malValuePtr meta(const malValuePtr& value);
+    String      print(const malValuePtr& value, bool readably);
+    malValuePtr withMeta(const malValuePtr& value, malValuePtr meta);
 };
 
 template<class T>
-T* value_cast(malValuePtr obj, const char* typeName) {
-    T* dest = dynamic_cast<T*>(obj.ptr());
+T* dynamic_value_cast(const malValuePtr& obj) {
+    return obj.isTagged() ? NULL : dynamic_cast<T*>(obj.ptr());
+}
+
+template<class T>
+T* value_cast(const malValuePtr& obj, const char* typeName) {
+    T* dest = dynamic_value_cast<T>(obj);
     MAL_CHECK(dest != NULL, "%s is not a %s",
-              obj->print(true).c_str(), typeName);
+              mal::print(obj, true).c_str(), typeName);
     return dest;
 }
 
 #define VALUE_CAST(Type, Value)    value_cast<Type>(Value, #Type)
-#define DYNAMIC_CAST(Type, Value)  (dynamic_cast<Type*>((Value).ptr()))
+#define DYNAMIC_CAST(Type, Value)  (dynamic_value_cast<Type>(Value))
 #define STATIC_CAST(Type, Value)   (static_cast<Type*>((Value).ptr()))
 
 #define WITH_META(Type) \
     virtual malValuePtr doWithMeta(malValuePtr meta) const { \
-        return new Type(*this, meta); \
+        return new Type(*this, std::move(meta)); \
     } \
 
+// nil, true and false. These are immortal singletons, so they can't have
+// metadata, as a copy carrying it would no longer be the same value.
 class malConstant : public malValue {
 public:
-    malConstant(String name) : m_name(name) { }
-    malConstant(const malConstant& that, malValuePtr meta)
-        : malValue(meta), m_name(that.m_name) { }
+    malConstant(String name, bool isTrue) : m_name(name), m_isTrue(isTrue) { }
 
     virtual String print(bool readably) const { return m_name; }
 
+    virtual bool isTrue() const { return m_isTrue; }
+
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return this == rhs; // these are singletons
     }
 
-    WITH_META(malConstant);
+    virtual malValuePtr doWithMeta(malValuePtr meta) const {
+        MAL_FAIL("%s can't have metadata", m_name.c_str());
+    }
 
 private:
     const String m_name;
+    const bool m_isTrue;
 };
 
 class malInteger : public malValue {
 public:
     malInteger(int64_t value) : m_value(value) { }
+    malInteger(int64_t value, malValuePtr meta)
+        : malValue(std::move(meta)), m_value(value) { }
     malInteger(const malInteger& that, malValuePtr meta)
-        : malValue(meta), m_value(that.m_value) { }
+        : malValue(std::move(meta)), m_value(that.m_value) { }
 
     virtual String print(bool readably) const {
         return std::to_string(m_value);
@@ -85,6 +146,8 @@ public:
 
     int64_t value() const { return m_value; }
 
+    virtual size_t hash() const { return std::hash<int64_t>()(m_value); }
+
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return m_value == static_cast<const malInteger*>(rhs)->m_value;
     }
@@ -95,87 +158,213 @@ private:
     const int64_t m_value;
 };
 
+// The text is held in one of three ways:
+//   - directly, in m_value;
+//   - as a view of part of another string's text, which it keeps alive in
+//     m_source, and which is only copied out if something needs value()
+//     of less than the whole of the source;
+//   - as a rope, the concatenation of m_source and m_right, which is only
+//     flattened into m_value when something needs the text.
 class malStringBase : public malValue {
 public:
     malStringBase(const String& token)
-        : m_value(token) { }
-    malStringBase(const malStringBase& that, malValuePtr meta)
-        : malValue(meta), m_value(that.value()) { }
+        : m_value(token), m_offset(0), m_length(token.size()) { }
+    malStringBase(const malStringBase& that, malValuePtr meta);
+
+    virtual String print(bool readably) const { return value(); }
 
-    virtual String print(bool readably) const { return m_value; }
+    const String& value() const {
+        return m_source ? sourceValue() : m_value;
+    }
+    const char* data() const {
+        return m_source ? sourceData() : m_value.data();
+    }
+    size_t length() const { return m_length; }
 
-    String value() const { return m_value; }
+    virtual void visitChildren(Visitor& visitor) const;
+
+protected:
+    malStringBase(const malStringBase* source, size_t offset, size_t length);
+    malStringBase(malValuePtr left, malValuePtr right);
 
 private:
-    const String m_value;
+    const malStringBase* source() const {
+        return static_cast<const malStringBase*>(m_source.ptr());
+    }
+    bool isRope() const { return m_right; }
+
+    // The string which holds the text that views of this one should use.
+    const malStringBase* owner() const;
+    size_t ownerOffset() const { return m_source ? m_offset : 0; }
+
+    const String& sourceValue() const;
+    const char* sourceData() const;
+    void flatten() const;
+
+    mutable String      m_value;
+    mutable malValuePtr m_source;
+    mutable malValuePtr m_right;
+    const size_t        m_offset;
+    const size_t        m_length;
 };
 
 class malString : public malStringBase {
 public:
     malString(const String& token)
-        : malStringBase(token) { }
+        : malStringBase(token), m_hash(0) { }
     malString(const malString& that, malValuePtr meta)
-        : malStringBase(that, meta) { }
+        : malStringBase(that, std::move(meta)), m_hash(that.m_hash) { }
 
     virtual String print(bool readably) const;
 
     String escapedValue() const;
 
+    // Shares this string's text rather than copying it.
+    malValuePtr substring(size_t offset, size_t length) const;
+
+    // Joins the strings into a rope, if they're long enough to be worth
+    // it, rather than copying them.
+    static malValuePtr concat(const malValuePtr& lhs, const malValuePtr& rhs);
+    static const size_t RopeThreshold = 256;
+
     virtual bool doIsEqualTo(const malValue* rhs) const {
-        return value() == static_cast<const malString*>(rhs)->value();
+        const malString* that = static_cast<const malString*>(rhs);
+        return (length() == that->length()) &&
+               (std::char_traits<char>::compare(data(), that->data(),
+                                                length()) == 0);
     }
 
+    virtual size_t hash() const;
+
     WITH_META(malString);
+
+private:
+    malString(const malString* source, size_t offset, size_t length)
+        : malStringBase(source, offset, length), m_hash(0) { }
+    malString(malValuePtr left, malValuePtr right)
+        : malStringBase(std::move(left), std::move(right)), m_hash(0) { }
+
+    mutable size_t m_hash; // 0 until it's first needed
 };
 
+// Keywords are interned by mal::keyword(), so there's a single, immortal
+// malKeyword for each name, and they carry their hash. Map operations on
+// keyword keys therefore never need to look at the name. Copies made by
+// with-meta refer back to the interned instance.
 class malKeyword : public malStringBase {
 public:
     malKeyword(const String& token)
-        : malStringBase(token) { }
+        : malStringBase(token)
+        , m_interned(this)
+        , m_hash(std::hash<String>()(token)) { }
     malKeyword(const malKeyword& that, malValuePtr meta)
-        : malStringBase(that, meta) { }
+        : malStringBase(that, std::move(meta))
+        , m_interned(that.m_interned)
+        , m_hash(that.m_hash) { }
+
+    virtual size_t hash() const { return m_hash; }
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
-        return value() == static_cast<const malKeyword*>(rhs)->value();
+        return m_interned == static_cast<const malKeyword*>(rhs)->m_interned;
     }
 
     WITH_META(malKeyword);
+
+private:
+    const malKeyword* const m_interned;
+    const size_t m_hash;
+};
+
+// Symbols are interned by mal::symbol(), so there's a single, immortal
+// malSymbol for each name, and they can be compared by id. Copies made by
+// with-meta share the id of the original. The symbols below are always
+// interned first, in this order, so their ids are known up front.
+enum malSymbolId {
+    SYM_AMPERSAND,
+    SYM_CATCH,
+    SYM_CONCAT,
+    SYM_CONS,
+    SYM_DEBUG_EVAL,
+    SYM_DEF,
+    SYM_DEFMACRO,
+    SYM_DO,
+    SYM_FN,
+    SYM_IF,
+    SYM_LET,
+    SYM_QUASIQUOTE,
+    SYM_QUOTE,
+    SYM_SPLICE_UNQUOTE,
+    SYM_TRY,
+    SYM_UNQUOTE,
+    SYM_VEC,
+    SYM_WITH_META,
 };
 
 class malSymbol : public malStringBase {
 public:
-    malSymbol(const String& token)
-        : malStringBase(token) { }
+    malSymbol(const String& token, int id)
+        : malStringBase(token), m_id(id) { }
     malSymbol(const malSymbol& that, malValuePtr meta)
-        : malStringBase(that, meta) { }
+        : malStringBase(that, std::move(meta)), m_id(that.m_id) { }
+
+    static malSymbol* fromId(int id);
+
+    virtual malValuePtr eval(const malEnvPtr& env);
 
-    virtual malValuePtr eval(malEnvPtr env);
+    int id() const { return m_id; }
+
+    // The interned instance, which is this unless we came from with-meta.
+    const malSymbol* interned() const { return fromId(m_id); }
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
-        return value() == static_cast<const malSymbol*>(rhs)->value();
+        return m_id == static_cast<const malSymbol*>(rhs)->m_id;
     }
 
+    virtual size_t hash() const { return std::hash<int>()(m_id); }
+
     WITH_META(malSymbol);
+
+private:
+    const int m_id;
 };
 
+// Sequences made from a known set of items hold them in the same
+// allocation as the object, straight after it, so that reading an item
+// is a single indirection, and short lists such as most code fit in a
+// cache line or two. These have to be allocated with the number of items,
+// as new (count) malList(...). Sequences which get their items some other
+// way only copy them into a separate, growable array if they're iterated
+// over.
 class malSequence : public malValue {
 public:
-    malSequence(malValueVec* items);
-    malSequence(malValueIter begin, malValueIter end);
     malSequence(const malSequence& that, malValuePtr meta);
     virtual ~malSequence();
 
+    static void* operator new(size_t size) {
+        return allocate(size, 0);
+    }
+    static void* operator new(size_t size, int count) {
+        return allocate(size, count);
+    }
+    static void operator delete(void* p);
+    static void operator delete(void* p, int count) {
+        operator delete(p);
+    }
+
     virtual String print(bool readably) const;
 
-    malValueVec* evalItems(malEnvPtr env) const;
-    int count() const { return m_items->size(); }
-    bool isEmpty() const { return m_items->empty(); }
-    malValuePtr item(int index) const { return (*m_items)[index]; }
+    malValueVec* evalItems(const malEnvPtr& env) const;
+    int count() const { return m_count; }
+    bool isEmpty() const { return m_count == 0; }
+    const malValuePtr& item(int index) const {
+        return m_items ? m_items[index] : lookup(index);
+    }
 
-    malValueIter begin() const { return m_items->begin(); }
-    malValueIter end()   const { return m_items->end(); }
+    malValueIter begin() const { return items(); }
+    malValueIter end()   const { return items() + m_count; }
 
     virtual bool doIsEqualTo(const malValue* rhs) const;
+    virtual size_t hash() const;
 
     virtual malValuePtr conj(malValueIter argsBegin,
                               malValueIter argsEnd) const = 0;
@@ -183,48 +372,146 @@ public:
     malValuePtr first() const;
     virtual malValuePtr rest() const;
 
+    // Returns a list of all but the first n items, which shares this
+    // sequence's items rather than copying them.
+    malValuePtr drop(int n) const;
+
+    virtual void visitChildren(Visitor& visitor) const;
+
+protected:
+    // Copies or moves the items into storage, which is the space after
+    // the derived object (see inlineItems).
+    malSequence(malValuePtr* storage, malValueIter begin, malValueIter end);
+    malSequence(malValuePtr* storage, malValueVec* items);
+
+    template<class T>
+    static malValuePtr* inlineItems(T* sequence) {
+        return reinterpret_cast<malValuePtr*>(sequence + 1);
+    }
+
+    // Sequences which hold their items some other way just pass the count,
+    // and provide lookup() for item(), and flatten() to copy the items out
+    // the first time they're iterated over.
+    malSequence(int count, malValuePtr meta);
+    virtual const malValuePtr& lookup(int index) const;
+    virtual malValueVec* flatten() const;
+
+    // A slice of another sequence's items, which it keeps alive.
+    malSequence(const malSequence* source, int offset);
+
+    // Sequences which hold their items some other way can change them in
+    // place if nothing else refers to them, and then call updated() to
+    // drop the flattened items and the cached hash.
+    bool canUpdate() const {
+        return isUnique() && !m_source && (!m_items || m_flattened);
+    }
+    void updated(int count);
+
 private:
-    malValueVec* const m_items;
+    static void* allocate(size_t size, int count);
+
+    malValuePtr* items() const {
+        if (!m_items && !m_flattened) {
+            m_flattened = flatten();
+            m_items = m_flattened->data();
+        }
+        return m_items;
+    }
+    const malSequence* owner() const;
+    void inheritMayBeCyclic();
+
+    // Inline, in m_flattened, or, for a slice, in m_source.
+    mutable malValuePtr* m_items;
+    mutable malValueVec* m_flattened;
+    const malValuePtr m_source;
+    int m_count;
+    mutable size_t m_hash; // 0 until it's first needed
 };
 
+// Lists are either a flat array of items, or a cons cell holding the
+// first item and the rest of the list, so that cons and rest don't copy.
 class malList : public malSequence {
 public:
-    malList(malValueVec* items) : malSequence(items) { }
+    malList(malValueVec* items)
+        : malSequence(inlineItems(this), items) { }
     malList(malValueIter begin, malValueIter end)
-        : malSequence(begin, end) { }
+        : malSequence(inlineItems(this), begin, end) { }
     malList(const malList& that, malValuePtr meta)
-        : malSequence(that, meta) { }
+        : malSequence(that, std::move(meta))
+        , m_first(that.m_first), m_rest(that.m_rest) { }
+    malList(malValuePtr first, malValuePtr rest);
+    malList(const malSequence* source, int offset)
+        : malSequence(source, offset) { }
 
     virtual String print(bool readably) const;
-    virtual malValuePtr eval(malEnvPtr env);
+    virtual malValuePtr eval(const malEnvPtr& env);
 
     virtual malValuePtr conj(malValueIter argsBegin,
                              malValueIter argsEnd) const;
+    virtual malValuePtr rest() const;
+
+    virtual void visitChildren(Visitor& visitor) const;
 
     WITH_META(malList);
+
+protected:
+    virtual const malValuePtr& lookup(int index) const;
+    virtual malValueVec* flatten() const;
+
+private:
+    bool isCell() const { return m_rest; }
+
+    // Only set for a cons cell, where m_rest is always a malList.
+    const malValuePtr m_first;
+    const malValuePtr m_rest;
 };
 
+// Vectors start out as a flat array of items, and are converted to a
+// VectorTrie by conj or assoc, so that building one up an item at a time
+// takes linear time.
 class malVector : public malSequence {
 public:
-    malVector(malValueVec* items) : malSequence(items) { }
+    malVector(malValueVec* items)
+        : malSequence(inlineItems(this), items) { }
     malVector(malValueIter begin, malValueIter end)
-        : malSequence(begin, end) { }
+        : malSequence(inlineItems(this), begin, end) { }
     malVector(const malVector& that, malValuePtr meta)
-        : malSequence(that, meta) { }
+        : malSequence(that, std::move(meta)), m_trie(that.m_trie) { }
+    malVector(const VectorTrie& trie);
 
-    virtual malValuePtr eval(malEnvPtr env);
+    virtual malValuePtr eval(const malEnvPtr& env);
     virtual String print(bool readably) const;
 
     virtual malValuePtr conj(malValueIter argsBegin,
                              malValueIter argsEnd) const;
+    malValuePtr assoc(int index, malValuePtr value) const;
+
+    // Like conj and assoc, but change this vector, which is only possible
+    // if nothing else refers to it, and it's already held in a trie.
+    // Returns false if it isn't.
+    bool conjInPlace(malValueIter argsBegin, malValueIter argsEnd);
+    bool assocInPlace(int index, const malValuePtr& value);
+
+    // The items as a trie, which is shared if this vector already has one.
+    VectorTrie trie() const;
+
+    virtual void visitChildren(Visitor& visitor) const;
 
     WITH_META(malVector);
+
+protected:
+    virtual const malValuePtr& lookup(int index) const;
+    virtual malValueVec* flatten() const;
+
+private:
+    // Empty unless this vector was made from a trie.
+    VectorTrie m_trie;
 };
 
 class malApplicable : public malValue {
 public:
     malApplicable() { }
-    malApplicable(malValuePtr meta) : malValue(meta) { }
+    malApplicable(malValuePtr meta) : malValue(std::move(meta)) { }
 
     virtual malValuePtr apply(malValueIter argsBegin,
                                malValueIter argsEnd) const = 0;
@@ -232,30 +519,110 @@ public:
 
 class malHash : public malValue {
 public:
-    typedef std::map<String, malValuePtr> Map;
+    // Keys may be any value, and are compared with mal::isEqual.
+    typedef HashTrie Map;
 
     malHash(malValueIter argsBegin, malValueIter argsEnd, bool isEvaluated);
     malHash(const malHash::Map& map);
     malHash(const malHash& that, malValuePtr meta)
-    : malValue(meta), m_map(that.m_map), m_isEvaluated(that.m_isEvaluated) { }
+    : malValue(std::move(meta))
+    , m_map(that.m_map)
+    , m_isEvaluated(that.m_isEvaluated)
+    , m_hash(that.m_hash) {
+        if (that.mayBeCyclic()) {
+            setMayBeCyclic();
+        }
+    }
 
     malValuePtr assoc(malValueIter argsBegin, malValueIter argsEnd) const;
     malValuePtr dissoc(malValueIter argsBegin, malValueIter argsEnd) const;
+
+    // Like assoc and dissoc, but change this map, which is only possible
+    // if nothing else refers to it. Returns false if something does, or
+    // if it's an unevaluated literal, as assoc and dissoc return an
+    // evaluated map.
+    bool assocInPlace(malValueIter argsBegin, malValueIter argsEnd);
+    bool dissocInPlace(malValueIter argsBegin, malValueIter argsEnd);
     bool contains(malValuePtr key) const;
-    malValuePtr eval(malEnvPtr env);
+    malValuePtr eval(const malEnvPtr& env);
     malValuePtr get(malValuePtr key) const;
     malValuePtr keys() const;
     malValuePtr values() const;
+    const Map& map() const { return m_map; }
 
     virtual String print(bool readably) const;
 
     virtual bool doIsEqualTo(const malValue* rhs) const;
+    virtual size_t hash() const;
+
+    virtual void visitChildren(Visitor& visitor) const;
 
     WITH_META(malHash);
 
 private:
-    const Map m_map;
+    void inheritMayBeCyclic();
+
+    Map m_map;
+    const bool m_isEvaluated;
+    mutable size_t m_hash; // 0 until it's first needed
+};
+
+class malSet : public malValue {
+public:
+    // Items may be any value, and are compared with mal::isEqual. They're
+    // the keys of a hash trie, each mapped to nil.
+    typedef HashTrie Items;
+
+    malSet(malValueIter argsBegin, malValueIter argsEnd, bool isEvaluated);
+    malSet(const malSet::Items& items);
+    malSet(const malSet& that, malValuePtr meta)
+    : malValue(std::move(meta))
+    , m_items(that.m_items)
+    , m_isEvaluated(that.m_isEvaluated)
+    , m_hash(that.m_hash) {
+        if (that.mayBeCyclic()) {
+            setMayBeCyclic();
+        }
+    }
+
+    malValuePtr conj(malValueIter argsBegin, malValueIter argsEnd) const;
+    malValuePtr disj(malValueIter argsBegin, malValueIter argsEnd) const;
+
+    // Like conj and disj, but change this set, which is only possible
+    // if nothing else refers to it. Returns false if something does, or
+    // if it's an unevaluated literal, as conj and disj return an
+    // evaluated set.
+    bool conjInPlace(malValueIter argsBegin, malValueIter argsEnd);
+    bool disjInPlace(malValueIter argsBegin, malValueIter argsEnd);
+
+    // Each of these walks the smaller of the two sets, and shares as much
+    // as it can with the larger.
+    malValuePtr unionWith(const malSet* that) const;
+    malValuePtr intersection(const malSet* that) const;
+    malValuePtr difference(const malSet* that) const;
+
+    bool contains(const malValuePtr& item) const;
+    int count() const { return m_items.count(); }
+    bool isEmpty() const { return m_items.isEmpty(); }
+    malValuePtr eval(const malEnvPtr& env);
+    malValuePtr seq() const;
+    const Items& items() const { return m_items; }
+
+    virtual String print(bool readably) const;
+
+    virtual bool doIsEqualTo(const malValue* rhs) const;
+    virtual size_t hash() const;
+
+    virtual void visitChildren(Visitor& visitor) const;
+
+    WITH_META(malSet);
+
+private:
+    void inheritMayBeCyclic();
+
+    Items m_items;
     const bool m_isEvaluated;
+    mutable size_t m_hash; // 0 until it's first needed
 };
 
 class malBuiltIn : public malApplicable {
@@ -268,7 +635,9 @@ public:
     : m_name(name), m_handler(handler) { }
 
     malBuiltIn(const malBuiltIn& that, malValuePtr meta)
-    : malApplicable(meta), m_name(that.m_name), m_handler(that.m_handler) { }
+    : malApplicable(std::move(meta))
+    , m_name(that.m_name)
+    , m_handler(that.m_handler) { }
 
     virtual malValuePtr apply(malValueIter argsBegin,
                               malValueIter argsEnd) const;
@@ -292,7 +661,7 @@ private:
 
 class malLambda : public malApplicable {
 public:
-    malLambda(const StringVec& bindings, malValuePtr body, malEnvPtr env);
+    malLambda(const malSymbolVec& bindings, malValuePtr body, malEnvPtr env);
     malLambda(const malLambda& that, malValuePtr meta);
     malLambda(const malLambda& that, bool isMacro);
 
@@ -301,6 +670,14 @@ public:
 
     malValuePtr getBody() const { return m_body; }
     malEnvPtr makeEnv(malValueIter argsBegin, malValueIter argsEnd) const;
+    malEnvPtr makeEnv(const malSequence* args) const;
+
+    // True if this takes a & parameter, which is cheaper to bind from a
+    // whole sequence than from a range.
+    bool isVariadic() const {
+        int n = m_bindings.size();
+        return (n >= 2) && (m_bindings[n-2]->id() == SYM_AMPERSAND);
+    }
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return this == rhs; // do we need to do a deep inspection?
@@ -314,30 +691,41 @@ public:
 
     virtual malValuePtr doWithMeta(malValuePtr meta) const;
 
+    virtual void visitChildren(Visitor& visitor) const;
+
 private:
-    const StringVec   m_bindings;
-    const malValuePtr m_body;
-    const malEnvPtr   m_env;
-    const bool        m_isMacro;
+    const malSymbolVec m_bindings;
+    const malValuePtr  m_body;
+    const malEnvPtr    m_env;
+    const bool         m_isMacro;
 };
 
 class malAtom : public malValue {
 public:
-    malAtom(malValuePtr value) : m_value(value) { }
+    malAtom(malValuePtr value) : m_value(std::move(value)) {
+        setMayBeCyclic();
+    }
     malAtom(const malAtom& that, malValuePtr meta)
-        : malValue(meta), m_value(that.m_value) { }
+        : malValue(std::move(meta)), m_value(that.m_value) {
+        setMayBeCyclic();
+    }
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
-        return this->m_value->isEqualTo(rhs);
+        return !m_value.isTagged() && m_value->isEqualTo(rhs);
     }
 
     virtual String print(bool readably) const {
-        return "(atom " + m_value->print(readably) + ")";
+        return "(atom " + mal::print(m_value, readably) + ")";
     };
 
     malValuePtr deref() const { return m_value; }
 
-    malValuePtr reset(malValuePtr value) { return m_value = value; }
+    malValuePtr reset(malValuePtr value) {
+        return m_value = std::move(value);
+    }
+
+    virtual void visitChildren(Visitor& visitor) const;
+    virtual void clearReferences();
 
     WITH_META(malAtom);
 
@@ -345,30 +733,92 @@ private:
     malValuePtr m_value;
 };
 
+// A vector or map which conj!, assoc! and dissoc! change in place, so
+// that building one up doesn't copy anything but the nodes it shares with
+// the value it was made from. persistent! turns it back into a vector or
+// map in constant time, after which it can't be changed.
+class malTransient : public malValue {
+public:
+    malTransient(const VectorTrie& vector);
+    malTransient(const malHash::Map& map);
+
+    void conj(malValueIter argsBegin, malValueIter argsEnd);
+    void assoc(malValueIter argsBegin, malValueIter argsEnd);
+    void dissoc(malValueIter argsBegin, malValueIter argsEnd);
+    malValuePtr persistent();
+
+    virtual String print(bool readably) const;
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return this == rhs;
+    }
+
+    virtual malValuePtr doWithMeta(malValuePtr meta) const {
+        MAL_FAIL("transients can't have metadata");
+    }
+
+    virtual void visitChildren(Visitor& visitor) const;
+    virtual void clearReferences();
+
+private:
+    void checkEditable() const;
+
+    const bool   m_isVector;
+    bool         m_isEditable;
+    VectorTrie   m_vector;
+    malHash::Map m_map;
+};
+
 namespace mal {
     malValuePtr atom(malValuePtr value);
-    malValuePtr boolean(bool value);
+    const malValuePtr& boolean(bool value);
     malValuePtr builtin(const String& name, malBuiltIn::ApplyFunc handler);
-    malValuePtr falseValue();
+    malValuePtr cons(malValuePtr first, malValuePtr rest);
+    const malValuePtr& falseValue();
     malValuePtr hash(malValueIter argsBegin, malValueIter argsEnd,
                      bool isEvaluated);
     malValuePtr hash(const malHash::Map& map);
-    malValuePtr integer(int64_t value);
     malValuePtr integer(const String& token);
     malValuePtr keyword(const String& token);
-    malValuePtr lambda(const StringVec&, malValuePtr, malEnvPtr);
+    malValuePtr lambda(const malSymbolVec&, malValuePtr, malEnvPtr);
     malValuePtr list(malValueVec* items);
     malValuePtr list(malValueIter begin, malValueIter end);
     malValuePtr list(malValuePtr a);
     malValuePtr list(malValuePtr a, malValuePtr b);
     malValuePtr list(malValuePtr a, malValuePtr b, malValuePtr c);
     malValuePtr macro(const malLambda& lambda);
-    malValuePtr nilValue();
+    const malValuePtr& nilValue();
+    malValuePtr set(malValueIter argsBegin, malValueIter argsEnd,
+                    bool isEvaluated);
+    malValuePtr set(const malSet::Items& items);
     malValuePtr string(const String& token);
     malValuePtr symbol(const String& token);
-    malValuePtr trueValue();
+    malValuePtr symbol(malSymbolId id);
+    const malValuePtr& trueValue();
     malValuePtr vector(malValueVec* items);
     malValuePtr vector(malValueIter begin, malValueIter end);
+
+    // Integers which fit are held in the pointer itself, shifted up a bit
+    // and tagged by the low bit, so arithmetic doesn't allocate. Only those
+    // too large for that, or carrying metadata, are boxed in a malInteger.
+    inline malValuePtr integer(int64_t value) {
+        if ((value >= (INTPTR_MIN >> 1)) && (value <= (INTPTR_MAX >> 1))) {
+            return malValuePtr::fromBits(
+                static_cast<intptr_t>(static_cast<uintptr_t>(value) << 1) | 1);
+        }
+        return malValuePtr(new malInteger(value));
+    }
+
+    inline bool isInteger(const malValuePtr& value) {
+        return value.isTagged() || DYNAMIC_CAST(malInteger, value);
+    }
+
+    inline int64_t integerValue(const malValuePtr& value) {
+        if (value.isTagged()) {
+            return value.bits() >> 1;
+        }
+        return VALUE_CAST(malInteger, value)->value();
+    }
 };
 
 #endif // INCLUDE_TYPES_H
@@ -0,0 +1,238 @@
+#include "VectorTrie.h"
+#include "Types.h"
+
+#include <algorithm>
+
+class VectorTrie::Leaf : public VectorNode {
+public:
+    Leaf() { }
+    Leaf(const Leaf& that, int count) {
+        std::copy(that.m_items, that.m_items + count, m_items);
+        if (that.mayBeCyclic()) {
+            setMayBeCyclic();
+        }
+    }
+
+    void set(int index, const malValuePtr& value) {
+        m_items[index] = value;
+        if (value && !value.isTagged() && value->mayBeCyclic()) {
+            setMayBeCyclic();
+        }
+    }
+
+    virtual void visitChildren(Visitor& visitor) const {
+        for (int i = 0; i < Width; i++) {
+            m_items[i].visit(visitor);
+        }
+    }
+
+    malValuePtr m_items[Width];
+};
+
+class VectorTrie::Branch : public VectorNode {
+public:
+    Branch() { }
+    Branch(const Branch& that) {
+        std::copy(that.m_children, that.m_children + Width, m_children);
+        if (that.mayBeCyclic()) {
+            setMayBeCyclic();
+        }
+    }
+
+    void set(int index, const VectorNodePtr& child) {
+        m_children[index] = child;
+        if (child && child->mayBeCyclic()) {
+            setMayBeCyclic();
+        }
+    }
+
+    virtual void visitChildren(Visitor& visitor) const {
+        for (int i = 0; i < Width; i++) {
+            m_children[i].visit(visitor);
+        }
+    }
+
+    VectorNodePtr m_children[Width];
+};
+
+VectorTrie::VectorTrie()
+: m_count(0)
+, m_shift(Bits)
+{
+
+}
+
+VectorTrie::VectorTrie(malValueIter begin, malValueIter end)
+: m_count(0)
+, m_shift(Bits)
+{
+    // Fill whole leaves directly, rather than copying the tail each time.
+    while (begin != end) {
+        Leaf* leaf = new Leaf;
+        VectorNodePtr node(leaf);
+        int n = std::min<int>(Width, end - begin);
+        for (int i = 0; i < n; i++) {
+            leaf->set(i, *begin++);
+        }
+        if (m_tail) {
+            pushTail(m_tail);
+        }
+        m_tail = node;
+        m_count += n;
+    }
+}
+
+const VectorTrie::Leaf* VectorTrie::leafFor(int index) const
+{
+    if (index >= tailOffset()) {
+        return static_cast<const Leaf*>(m_tail.ptr());
+    }
+    const VectorNode* node = m_root.ptr();
+    for (int level = m_shift; level > 0; level -= Bits) {
+        node = static_cast<const Branch*>(node)->
+            m_children[(index >> level) & Mask].ptr();
+    }
+    return static_cast<const Leaf*>(node);
+}
+
+const malValuePtr& VectorTrie::item(int index) const
+{
+    return leafFor(index)->m_items[index & Mask];
+}
+
+// Returns the node that ptr refers to, having replaced it with a copy if
+// it's shared with another trie, so that it can be changed in place.
+VectorTrie::Branch* VectorTrie::editableBranch(VectorNodePtr& ptr)
+{
+    if (!ptr) {
+        ptr = new Branch;
+    }
+    else if (!ptr->isUnique()) {
+        ptr = new Branch(*static_cast<const Branch*>(ptr.ptr()));
+    }
+    return static_cast<Branch*>(ptr.ptr());
+}
+
+// Leaves only copy the first count items, as the rest are empty.
+VectorTrie::Leaf* VectorTrie::editableLeaf(VectorNodePtr& ptr, int count)
+{
+    if (!ptr->isUnique()) {
+        ptr = new Leaf(*static_cast<const Leaf*>(ptr.ptr()), count);
+    }
+    return static_cast<Leaf*>(ptr.ptr());
+}
+
+static bool isCyclic(const malValuePtr& value)
+{
+    return value && !value.isTagged() && value->mayBeCyclic();
+}
+
+// Adds a full tail to the trie. m_count must still include it.
+void VectorTrie::pushTail(VectorNodePtr tail)
+{
+    // Grow a new root when the trie is full at this depth.
+    if (m_root && (((m_count - 1) >> Bits) >= (1 << m_shift))) {
+        Branch* root = new Branch;
+        VectorNodePtr node(root);
+        root->set(0, m_root);
+        m_root = node;
+        m_shift += Bits;
+    }
+
+    // Make the path down to the new leaf editable, creating any missing
+    // branches. Each branch on the path is changed after its parent, so
+    // they all have to be told if the leaf may be part of a cycle.
+    bool cyclic = tail->mayBeCyclic();
+    Branch* parent = editableBranch(m_root);
+    for (int level = m_shift; level > Bits; level -= Bits) {
+        if (cyclic) {
+            parent->setMayBeCyclic();
+        }
+        parent = editableBranch(
+            parent->m_children[((m_count - 1) >> level) & Mask]);
+    }
+    parent->set(((m_count - 1) >> Bits) & Mask, tail);
+}
+
+VectorTrie VectorTrie::conj(const malValuePtr& value) const
+{
+    VectorTrie result(*this);
+    result.push(value);
+    return result;
+}
+
+VectorTrie VectorTrie::assoc(int index, const malValuePtr& value) const
+{
+    VectorTrie result(*this);
+    result.set(index, value);
+    return result;
+}
+
+void VectorTrie::push(const malValuePtr& value)
+{
+    int tailCount = m_count - tailOffset();
+    if (m_tail && (tailCount < Width)) {
+        editableLeaf(m_tail, tailCount)->set(tailCount, value);
+    }
+    else {
+        if (m_tail) {
+            pushTail(m_tail);
+        }
+        Leaf* tail = new Leaf;
+        m_tail = tail;
+        tail->set(0, value);
+    }
+    m_count++;
+}
+
+void VectorTrie::set(int index, const malValuePtr& value)
+{
+    if (index == m_count) {
+        push(value);
+        return;
+    }
+
+    int offset = tailOffset();
+    if (index >= offset) {
+        editableLeaf(m_tail, m_count - offset)->set(index & Mask, value);
+        return;
+    }
+
+    bool cyclic = isCyclic(value);
+    Branch* parent = editableBranch(m_root);
+    for (int level = m_shift; level > Bits; level -= Bits) {
+        if (cyclic) {
+            parent->setMayBeCyclic();
+        }
+        parent = editableBranch(parent->m_children[(index >> level) & Mask]);
+    }
+    if (cyclic) {
+        parent->setMayBeCyclic();
+    }
+    editableLeaf(parent->m_children[(index >> Bits) & Mask], Width)->
+        set(index & Mask, value);
+}
+
+malValueVec* VectorTrie::flatten() const
+{
+    malValueVec* items = new malValueVec;
+    items->reserve(m_count);
+    for (int i = 0; i < m_count; i += Width) {
+        const Leaf* leaf = leafFor(i);
+        int n = std::min(Width, m_count - i);
+        items->insert(items->end(), leaf->m_items, leaf->m_items + n);
+    }
+    return items;
+}
+
+bool VectorTrie::mayBeCyclic() const
+{
+    return (m_root && m_root->mayBeCyclic()) ||
+           (m_tail && m_tail->mayBeCyclic());
+}
+
+void VectorTrie::visit(RefCounted::Visitor& visitor) const
+{
+    m_root.visit(visitor);
+    m_tail.visit(visitor);
+}
@@ -0,0 +1,65 @@
+#ifndef INCLUDE_VECTORTRIE_H
+#define INCLUDE_VECTORTRIE_H
+
+#include "MAL.h"
+
+class VectorNode : public RefCounted {
+public:
+    static void* operator new(size_t size) {
+        return Allocator::allocate(size);
+    }
+    static void operator delete(void* p, size_t size) {
+        Allocator::deallocate(p, size);
+    }
+};
+typedef RefCountedPtr<VectorNode> VectorNodePtr;
+
+// A persistent vector, as in Clojure: a 32-way trie holding all but the
+// last few items, which are held in a separate tail. Adding an item only
+// copies the tail, or, once that's full, the path down to where it goes,
+// and everything else is shared with the original.
+class VectorTrie {
+public:
+    static const int Bits  = 5;
+    static const int Width = 1 << Bits;
+    static const int Mask  = Width - 1;
+
+    VectorTrie();
+    VectorTrie(malValueIter begin, malValueIter end);
+
+    int count() const { return m_count; }
+    const malValuePtr& item(int index) const;
+
+    VectorTrie conj(const malValuePtr& value) const;
+    VectorTrie assoc(int index, const malValuePtr& value) const;
+
+    // Like conj and assoc, but change this trie, only copying the nodes
+    // which are shared with another trie, and updating the rest in place.
+    void push(const malValuePtr& value);
+    void set(int index, const malValuePtr& value);
+
+    malValueVec* flatten() const;
+
+    bool mayBeCyclic() const;
+    void visit(RefCounted::Visitor& visitor) const;
+
+private:
+    class Leaf;
+    class Branch;
+
+    int tailOffset() const {
+        return (m_count < Width) ? 0 : ((m_count - 1) >> Bits) << Bits;
+    }
+    const Leaf* leafFor(int index) const;
+    void pushTail(VectorNodePtr tail);
+
+    static Branch* editableBranch(VectorNodePtr& ptr);
+    static Leaf* editableLeaf(VectorNodePtr& ptr, int count);
+
+    VectorNodePtr m_root;
+    VectorNodePtr m_tail;
+    int           m_count;
+    int           m_shift;
+};
+
+#endif // INCLUDE_VECTORTRIE_H
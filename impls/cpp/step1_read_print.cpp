@@ -51,7 +51,7 @@ static malValuePtr EVAL(malValuePtr ast)
 
 String PRINT(malValuePtr ast)
 {
-    return ast->print(true);
+    return mal::print(ast, true);
 }
 
 // These have been added after step 1 to keep the linker happy.
@@ -60,7 +60,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr)
     return ast;
 }
 
-malValuePtr APPLY(malValuePtr ast, malValueIter, malValueIter)
+malValuePtr APPLY(const malValuePtr& ast, malValueIter, malValueIter)
 {
     return ast;
 }
@@ -53,24 +53,26 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
 {
     // std::cout << "EVAL: " << PRINT(ast) << "\n";
 
-    return ast->eval(env);
+    return mal::eval(ast, env);
 }
 
 String PRINT(malValuePtr ast)
 {
-    return ast->print(true);
+    return mal::print(ast, true);
 }
 
-malValuePtr APPLY(malValuePtr op, malValueIter argsBegin, malValueIter argsEnd)
+malValuePtr APPLY(const malValuePtr& op,
+                  malValueIter argsBegin, malValueIter argsEnd)
 {
     const malApplicable* handler = DYNAMIC_CAST(malApplicable, op);
     MAL_CHECK(handler != NULL,
-              "\"%s\" is not applicable", op->print(true).c_str());
+              "\"%s\" is not applicable", mal::print(op, true).c_str());
 
     return handler->apply(argsBegin, argsEnd);
 }
 
 #define ARG(type, name) type* name = VALUE_CAST(type, *argsBegin++)
+#define ARG_INTEGER(name) int64_t name = mal::integerValue(*argsBegin++)
 
 #define CHECK_ARGS_IS(expected) \
     checkArgsIs(name.c_str(), expected, std::distance(argsBegin, argsEnd))
@@ -83,38 +85,38 @@ static malValuePtr builtIn_add(const String& name,
     malValueIter argsBegin, malValueIter argsEnd)
 {
         CHECK_ARGS_IS(2);
-        ARG(malInteger, lhs);
-        ARG(malInteger, rhs);
-        return mal::integer(lhs->value() + rhs->value());
+        ARG_INTEGER(lhs);
+        ARG_INTEGER(rhs);
+        return mal::integer(lhs + rhs);
 }
 
 static malValuePtr builtIn_sub(const String& name,
     malValueIter argsBegin, malValueIter argsEnd)
 {
         int argCount = CHECK_ARGS_BETWEEN(1, 2);
-        ARG(malInteger, lhs);
+        ARG_INTEGER(lhs);
         if (argCount == 1) {
-            return mal::integer(- lhs->value());
+            return mal::integer(- lhs);
         }
-        ARG(malInteger, rhs);
-        return mal::integer(lhs->value() - rhs->value());
+        ARG_INTEGER(rhs);
+        return mal::integer(lhs - rhs);
 }
 
 static malValuePtr builtIn_mul(const String& name,
     malValueIter argsBegin, malValueIter argsEnd)
 {
         CHECK_ARGS_IS(2);
-        ARG(malInteger, lhs);
-        ARG(malInteger, rhs);
-        return mal::integer(lhs->value() * rhs->value());
+        ARG_INTEGER(lhs);
+        ARG_INTEGER(rhs);
+        return mal::integer(lhs * rhs);
 }
 
 static malValuePtr builtIn_div(const String& name,
     malValueIter argsBegin, malValueIter argsEnd)
 {
         CHECK_ARGS_IS(2);
-        ARG(malInteger, lhs);
-        ARG(malInteger, rhs);
-        MAL_CHECK(rhs->value() != 0, "Division by zero"); \
-        return mal::integer(lhs->value() / rhs->value());
+        ARG_INTEGER(lhs);
+        ARG_INTEGER(rhs);
+        MAL_CHECK(rhs != 0, "Division by zero"); \
+        return mal::integer(lhs / rhs);
 }
@@ -51,29 +51,30 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
         env = replEnv;
     }
 
-    const malEnvPtr dbgenv = env->find("DEBUG-EVAL");
-    if (dbgenv && dbgenv->get("DEBUG-EVAL")->isTrue()) {
+    const malSymbol* debugEval = malSymbol::fromId(SYM_DEBUG_EVAL);
+    const malEnvPtr dbgenv = env->find(debugEval);
+    if (dbgenv && mal::isTrue(dbgenv->get(debugEval))) {
         std::cout << "EVAL: " << PRINT(ast) << "\n";
     }
 
     const malList* list = DYNAMIC_CAST(malList, ast);
     if (!list || (list->count() == 0)) {
-        return ast->eval(env);
+        return mal::eval(ast, env);
     }
 
     // From here on down we are evaluating a non-empty list.
     // First handle the special forms.
     if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, list->item(0))) {
-        String special = symbol->value();
+        int special = symbol->id();
         int argCount = list->count() - 1;
 
-        if (special == "def!") {
+        if (special == SYM_DEF) {
             checkArgsIs("def!", 2, argCount);
             const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
-            return env->set(id->value(), EVAL(list->item(2), env));
+            return env->set(id, EVAL(list->item(2), env));
         }
 
-        if (special == "let*") {
+        if (special == SYM_LET) {
             checkArgsIs("let*", 2, argCount);
             const malSequence* bindings =
                 VALUE_CAST(malSequence, list->item(1));
@@ -82,7 +83,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
             for (int i = 0; i < count; i += 2) {
                 const malSymbol* var =
                     VALUE_CAST(malSymbol, bindings->item(i));
-                inner->set(var->value(), EVAL(bindings->item(i+1), inner));
+                inner->set(var, EVAL(bindings->item(i+1), inner));
             }
             return EVAL(list->item(2), inner);
         }
@@ -91,19 +92,20 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
     // Now we're left with the case of a regular list to be evaluated.
     std::unique_ptr<malValueVec> items(list->evalItems(env));
     malValuePtr op = items->at(0);
-    return APPLY(op, items->begin()+1, items->end());
+    return APPLY(op, items->data()+1, items->data() + items->size());
 }
 
 String PRINT(malValuePtr ast)
 {
-    return ast->print(true);
+    return mal::print(ast, true);
 }
 
-malValuePtr APPLY(malValuePtr op, malValueIter argsBegin, malValueIter argsEnd)
+malValuePtr APPLY(const malValuePtr& op,
+                  malValueIter argsBegin, malValueIter argsEnd)
 {
     const malApplicable* handler = DYNAMIC_CAST(malApplicable, op);
     MAL_CHECK(handler != NULL,
-              "\"%s\" is not applicable", op->print(true).c_str());
+              "\"%s\" is not applicable", mal::print(op, true).c_str());
 
     return handler->apply(argsBegin, argsEnd);
 }
@@ -52,30 +52,32 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
     if (!env) {
         env = replEnv;
     }
+    RefCounted::reclaim();
 
-    const malEnvPtr dbgenv = env->find("DEBUG-EVAL");
-    if (dbgenv && dbgenv->get("DEBUG-EVAL")->isTrue()) {
+    const malSymbol* debugEval = malSymbol::fromId(SYM_DEBUG_EVAL);
+    const malEnvPtr dbgenv = env->find(debugEval);
+    if (dbgenv && mal::isTrue(dbgenv->get(debugEval))) {
         std::cout << "EVAL: " << PRINT(ast) << "\n";
     }
 
     const malList* list = DYNAMIC_CAST(malList, ast);
     if (!list || (list->count() == 0)) {
-        return ast->eval(env);
+        return mal::eval(ast, env);
     }
 
     // From here on down we are evaluating a non-empty list.
     // First handle the special forms.
     if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, list->item(0))) {
-        String special = symbol->value();
+        int special = symbol->id();
         int argCount = list->count() - 1;
 
-        if (special == "def!") {
+        if (special == SYM_DEF) {
             checkArgsIs("def!", 2, argCount);
             const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
-            return env->set(id->value(), EVAL(list->item(2), env));
+            return env->set(id, EVAL(list->item(2), env));
         }
 
-        if (special == "do") {
+        if (special == SYM_DO) {
             checkArgsAtLeast("do", 1, argCount);
 
             for (int i = 1; i < argCount; i++) {
@@ -84,32 +86,32 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
             return EVAL(list->item(argCount), env);
         }
 
-        if (special == "fn*") {
+        if (special == SYM_FN) {
             checkArgsIs("fn*", 2, argCount);
 
             const malSequence* bindings =
                 VALUE_CAST(malSequence, list->item(1));
-            StringVec params;
+            malSymbolVec params;
             for (int i = 0; i < bindings->count(); i++) {
                 const malSymbol* sym =
                     VALUE_CAST(malSymbol, bindings->item(i));
-                params.push_back(sym->value());
+                params.push_back(sym->interned());
             }
 
             return mal::lambda(params, list->item(2), env);
         }
 
-        if (special == "if") {
+        if (special == SYM_IF) {
             checkArgsBetween("if", 2, 3, argCount);
 
-            bool isTrue = EVAL(list->item(1), env)->isTrue();
+            bool isTrue = mal::isTrue(EVAL(list->item(1), env));
             if (!isTrue && (argCount == 2)) {
                 return mal::nilValue();
             }
             return EVAL(list->item(isTrue ? 2 : 3), env);
         }
 
-        if (special == "let*") {
+        if (special == SYM_LET) {
             checkArgsIs("let*", 2, argCount);
             const malSequence* bindings =
                 VALUE_CAST(malSequence, list->item(1));
@@ -118,7 +120,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
             for (int i = 0; i < count; i += 2) {
                 const malSymbol* var =
                     VALUE_CAST(malSymbol, bindings->item(i));
-                inner->set(var->value(), EVAL(bindings->item(i+1), inner));
+                inner->set(var, EVAL(bindings->item(i+1), inner));
             }
             return EVAL(list->item(2), inner);
         }
@@ -129,23 +131,25 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
     malValuePtr op = items->at(0);
     if (const malLambda* lambda = DYNAMIC_CAST(malLambda, op)) {
         return EVAL(lambda->getBody(),
-                    lambda->makeEnv(items->begin()+1, items->end()));
+                    lambda->makeEnv(items->data()+1,
+                                    items->data() + items->size()));
     }
     else {
-        return APPLY(op, items->begin()+1, items->end());
+        return APPLY(op, items->data()+1, items->data() + items->size());
     }
 }
 
 String PRINT(malValuePtr ast)
 {
-    return ast->print(true);
+    return mal::print(ast, true);
 }
 
-malValuePtr APPLY(malValuePtr op, malValueIter argsBegin, malValueIter argsEnd)
+malValuePtr APPLY(const malValuePtr& op,
+                  malValueIter argsBegin, malValueIter argsEnd)
 {
     const malApplicable* handler = DYNAMIC_CAST(malApplicable, op);
     MAL_CHECK(handler != NULL,
-              "\"%s\" is not applicable", op->print(true).c_str());
+              "\"%s\" is not applicable", mal::print(op, true).c_str());
 
     return handler->apply(argsBegin, argsEnd);
 }
@@ -49,7 +49,7 @@ static String safeRep(const String& input, malEnvPtr env)
         return String();
     }
     catch (malValuePtr& mv) {
-        return "Error: " + mv->print(true);
+        return "Error: " + mal::print(mv, true);
     }
     catch (String& s) {
         return "Error: " + s;
@@ -81,39 +81,41 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
         env = replEnv;
     }
     while (1) {
+        RefCounted::reclaim();
 
-       const malEnvPtr dbgenv = env->find("DEBUG-EVAL");
-       if (dbgenv && dbgenv->get("DEBUG-EVAL")->isTrue()) {
+       const malSymbol* debugEval = malSymbol::fromId(SYM_DEBUG_EVAL);
+       const malEnvPtr dbgenv = env->find(debugEval);
+       if (dbgenv && mal::isTrue(dbgenv->get(debugEval))) {
            std::cout << "EVAL: " << PRINT(ast) << "\n";
        }
 
         const malList* list = DYNAMIC_CAST(malList, ast);
         if (!list || (list->count() == 0)) {
-            return ast->eval(env);
+            return mal::eval(ast, env);
         }
 
         // From here on down we are evaluating a non-empty list.
         // First handle the special forms.
         if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, list->item(0))) {
-            String special = symbol->value();
+            int special = symbol->id();
             int argCount = list->count() - 1;
 
-            if (special == "def!") {
+            if (special == SYM_DEF) {
                 checkArgsIs("def!", 2, argCount);
                 const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
-                return env->set(id->value(), EVAL(list->item(2), env));
+                return env->set(id, EVAL(list->item(2), env));
             }
 
-            if (special == "defmacro!") {
+            if (special == SYM_DEFMACRO) {
                 checkArgsIs("defmacro!", 2, argCount);
 
                 const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
                 malValuePtr body = EVAL(list->item(2), env);
                 const malLambda* lambda = VALUE_CAST(malLambda, body);
-                return env->set(id->value(), mal::macro(*lambda));
+                return env->set(id, mal::macro(*lambda));
             }
 
-            if (special == "do") {
+            if (special == SYM_DO) {
                 checkArgsAtLeast("do", 1, argCount);
 
                 for (int i = 1; i < argCount; i++) {
@@ -123,25 +125,25 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                 continue; // TCO
             }
 
-            if (special == "fn*") {
+            if (special == SYM_FN) {
                 checkArgsIs("fn*", 2, argCount);
 
                 const malSequence* bindings =
                     VALUE_CAST(malSequence, list->item(1));
-                StringVec params;
+                malSymbolVec params;
                 for (int i = 0; i < bindings->count(); i++) {
                     const malSymbol* sym =
                         VALUE_CAST(malSymbol, bindings->item(i));
-                    params.push_back(sym->value());
+                    params.push_back(sym->interned());
                 }
 
                 return mal::lambda(params, list->item(2), env);
             }
 
-            if (special == "if") {
+            if (special == SYM_IF) {
                 checkArgsBetween("if", 2, 3, argCount);
 
-                bool isTrue = EVAL(list->item(1), env)->isTrue();
+                bool isTrue = mal::isTrue(EVAL(list->item(1), env));
                 if (!isTrue && (argCount == 2)) {
                     return mal::nilValue();
                 }
@@ -149,7 +151,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                 continue; // TCO
             }
 
-            if (special == "let*") {
+            if (special == SYM_LET) {
                 checkArgsIs("let*", 2, argCount);
                 const malSequence* bindings =
                     VALUE_CAST(malSequence, list->item(1));
@@ -158,25 +160,25 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                 for (int i = 0; i < count; i += 2) {
                     const malSymbol* var =
                         VALUE_CAST(malSymbol, bindings->item(i));
-                    inner->set(var->value(), EVAL(bindings->item(i+1), inner));
+                    inner->set(var, EVAL(bindings->item(i+1), inner));
                 }
                 ast = list->item(2);
                 env = inner;
                 continue; // TCO
             }
 
-            if (special == "quasiquote") {
+            if (special == SYM_QUASIQUOTE) {
                 checkArgsIs("quasiquote", 1, argCount);
                 ast = quasiquote(list->item(1));
                 continue; // TCO
             }
 
-            if (special == "quote") {
+            if (special == SYM_QUOTE) {
                 checkArgsIs("quote", 1, argCount);
                 return list->item(1);
             }
 
-            if (special == "try*") {
+            if (special == SYM_TRY) {
                 malValuePtr tryBody = list->item(1);
 
                 if (argCount == 1) {
@@ -188,7 +190,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
 
                 checkArgsIs("catch*", 2, catchBlock->count() - 1);
                 MAL_CHECK(VALUE_CAST(malSymbol,
-                    catchBlock->item(0))->value() == "catch*",
+                    catchBlock->item(0))->id() == SYM_CATCH,
                     "catch block must begin with catch*");
 
                 // We don't need excSym at this scope, but we want to check
@@ -216,7 +218,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                 if (excVal) {
                     // we got some exception
                     env = malEnvPtr(new malEnv(env));
-                    env->set(excSym->value(), excVal);
+                    env->set(excSym, excVal);
                     ast = catchBlock->item(2);
                 }
                 continue; // TCO
@@ -230,72 +232,77 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                 ast = lambda->apply(list->begin()+1, list->end());
                 continue; // TCO
             }
-            malValueVec* items = STATIC_CAST(malList, list->rest())->evalItems(env);
+            std::unique_ptr<malValueVec> items(
+                STATIC_CAST(malList, list->rest())->evalItems(env));
             ast = lambda->getBody();
-            env = lambda->makeEnv(items->begin(), items->end());
+            env = lambda->makeEnv(items->data(), items->data() + items->size());
             continue; // TCO
         }
         else {
-            malValueVec* items = STATIC_CAST(malList, list->rest())->evalItems(env);
-            return APPLY(op, items->begin(), items->end());
+            std::unique_ptr<malValueVec> items(
+                STATIC_CAST(malList, list->rest())->evalItems(env));
+            return APPLY(op, items->data(), items->data() + items->size());
         }
     }
 }
 
 String PRINT(malValuePtr ast)
 {
-    return ast->print(true);
+    return mal::print(ast, true);
 }
 
-malValuePtr APPLY(malValuePtr op, malValueIter argsBegin, malValueIter argsEnd)
+malValuePtr APPLY(const malValuePtr& op,
+                  malValueIter argsBegin, malValueIter argsEnd)
 {
     const malApplicable* handler = DYNAMIC_CAST(malApplicable, op);
     MAL_CHECK(handler != NULL,
-              "\"%s\" is not applicable", op->print(true).c_str());
+              "\"%s\" is not applicable", mal::print(op, true).c_str());
 
     return handler->apply(argsBegin, argsEnd);
 }
 
-static bool isSymbol(malValuePtr obj, const String& text)
+static bool isSymbol(malValuePtr obj, malSymbolId id)
 {
     const malSymbol* sym = DYNAMIC_CAST(malSymbol, obj);
-    return sym && (sym->value() == text);
+    return sym && (sym->id() == id);
 }
 
 //  Return arg when ast matches ('sym, arg), else NULL.
-static malValuePtr starts_with(const malValuePtr ast, const char* sym)
+static malValuePtr starts_with(const malValuePtr ast, malSymbolId sym)
 {
     const malList* list = DYNAMIC_CAST(malList, ast);
     if (!list || list->isEmpty() || !isSymbol(list->item(0), sym))
         return NULL;
-    checkArgsIs(sym, 1, list->count() - 1);
+    checkArgsIs(malSymbol::fromId(sym)->value().c_str(),
+                1, list->count() - 1);
     return list->item(1);
 }
 
 static malValuePtr quasiquote(malValuePtr obj)
 {
-    if (DYNAMIC_CAST(malSymbol, obj) || DYNAMIC_CAST(malHash, obj))
-        return mal::list(mal::symbol("quote"), obj);
+    if (DYNAMIC_CAST(malSymbol, obj) || DYNAMIC_CAST(malHash, obj) ||
+        DYNAMIC_CAST(malSet, obj))
+        return mal::list(mal::symbol(SYM_QUOTE), obj);
 
     const malSequence* seq = DYNAMIC_CAST(malSequence, obj);
     if (!seq)
         return obj;
 
-    const malValuePtr unquoted = starts_with(obj, "unquote");
+    const malValuePtr unquoted = starts_with(obj, SYM_UNQUOTE);
     if (unquoted)
         return unquoted;
 
     malValuePtr res = mal::list(new malValueVec(0));
     for (int i=seq->count()-1; 0<=i; i--) {
         const malValuePtr elt     = seq->item(i);
-        const malValuePtr spl_unq = starts_with(elt, "splice-unquote");
+        const malValuePtr spl_unq = starts_with(elt, SYM_SPLICE_UNQUOTE);
         if (spl_unq)
-            res = mal::list(mal::symbol("concat"), spl_unq, res);
+            res = mal::list(mal::symbol(SYM_CONCAT), spl_unq, res);
          else
-            res = mal::list(mal::symbol("cons"), quasiquote(elt), res);
+            res = mal::list(mal::symbol(SYM_CONS), quasiquote(elt), res);
     }
     if (DYNAMIC_CAST(malVector, obj))
-        res = mal::list(mal::symbol("vec"), res);
+        res = mal::list(mal::symbol(SYM_VEC), res);
     return res;
 }
 